@@ -0,0 +1,121 @@
+#include "sys.h"
+#include "AtomCache.h"
+#include "utils/AIAlert.h"
+#include <algorithm>
+#include <cstdlib>
+#include "debug.h"
+
+namespace xcb {
+
+void AtomCache::Maps::insert(std::string_view name, xcb_atom_t atom)
+{
+  auto name_iter = m_name_to_atom.emplace(std::string{name}, atom).first;
+  m_atom_to_name.emplace(atom, name_iter->first);
+}
+
+void AtomCache::send_intern_requests(std::span<std::string_view const> names, InternRequests& requests)
+{
+  DoutEntering(dc::notice, "xcb::AtomCache::send_intern_requests(" << names.size() << " names)");
+  requests.m_names.assign(names.begin(), names.end());
+  requests.m_cookies.resize(names.size());
+  requests.m_atoms.resize(names.size());
+  requests.m_replies = std::make_unique<AsyncReply[]>(names.size());
+  requests.m_next_reply = 0;
+
+  maps_t::wat maps_w(m_maps);
+  for (size_t i = 0; i < names.size(); ++i)
+  {
+    auto iter = maps_w->m_name_to_atom.find(names[i]);
+    if (iter != maps_w->m_name_to_atom.end())
+    {
+      requests.m_atoms[i] = iter->second;
+      requests.m_cookies[i].sequence = 0;
+      continue;
+    }
+    requests.m_cookies[i] = xcb_intern_atom(m_connection, 0, names[i].size(), names[i].data());
+  }
+  // Make sure the requests are sent, otherwise we could wait forever.
+  xcb_flush(m_connection);
+}
+
+void AtomCache::store_reply(InternRequests& requests, xcb_intern_atom_reply_t const* reply)
+{
+  size_t const i = requests.m_next_reply;
+  if (!reply)
+    THROW_ALERT("Failed to intern atom \"[NAME]\"", AIArgs("[NAME]", requests.m_names[i]));
+  requests.m_atoms[i] = reply->atom;
+  maps_t::wat maps_w(m_maps);
+  maps_w->insert(requests.m_names[i], requests.m_atoms[i]);
+}
+
+bool AtomCache::poll_intern_replies(InternRequests& requests)
+{
+  // Replies arrive in the order of the requests.
+  for (; requests.m_next_reply < requests.m_cookies.size(); ++requests.m_next_reply)
+  {
+    if (requests.m_cookies[requests.m_next_reply].sequence == 0)
+      continue;
+    AsyncReply& reply = requests.m_replies[requests.m_next_reply];
+    if (!reply.ready())
+      return false;
+    store_reply(requests, reply.get<xcb_intern_atom_reply_t>());
+    reply.reset();
+  }
+  requests.m_replies.reset();
+  return true;
+}
+
+void AtomCache::wait_for_intern_replies(InternRequests& requests)
+{
+  for (; requests.m_next_reply < requests.m_cookies.size(); ++requests.m_next_reply)
+  {
+    xcb_intern_atom_cookie_t const cookie = requests.m_cookies[requests.m_next_reply];
+    if (cookie.sequence == 0)
+      continue;
+    xcb_generic_error_t* error = nullptr;
+    xcb_intern_atom_reply_t* reply = xcb_intern_atom_reply(m_connection, cookie, &error);
+    free(error);
+    store_reply(requests, reply);
+    free(reply);
+  }
+  requests.m_replies.reset();
+}
+
+void AtomCache::intern(std::span<std::string_view const> names, std::span<xcb_atom_t> atoms_out)
+{
+  ASSERT(names.size() == atoms_out.size());
+  InternRequests requests;
+  send_intern_requests(names, requests);
+  wait_for_intern_replies(requests);
+  std::copy(requests.m_atoms.begin(), requests.m_atoms.end(), atoms_out.begin());
+}
+
+xcb_atom_t AtomCache::find(std::string_view name) const
+{
+  maps_t::wat maps_w(m_maps);
+  auto iter = maps_w->m_name_to_atom.find(name);
+  return iter == maps_w->m_name_to_atom.end() ? XCB_ATOM_NONE : iter->second;
+}
+
+std::string_view AtomCache::name(xcb_atom_t atom) const
+{
+  {
+    maps_t::wat maps_w(m_maps);
+    auto iter = maps_w->m_atom_to_name.find(atom);
+    if (iter != maps_w->m_atom_to_name.end())
+      return iter->second;
+  }
+
+  xcb_get_atom_name_cookie_t atom_name_cookie = xcb_get_atom_name(m_connection, atom);
+  xcb_get_atom_name_reply_t* reply = xcb_get_atom_name_reply(m_connection, atom_name_cookie, nullptr);
+  if (!reply)
+    return {};
+  std::string_view atom_name(xcb_get_atom_name_name(reply), xcb_get_atom_name_name_length(reply));
+  maps_t::wat maps_w(m_maps);
+  maps_w->insert(atom_name, atom);
+  free(reply);
+  // Entries are never removed, so the returned string_view stays valid.
+  return maps_w->m_atom_to_name.find(atom)->second;
+}
+
+} // namespace xcb
@@ -0,0 +1,100 @@
+#pragma once
+
+#include "PendingReplies.h"
+#include "threadsafe/threadsafe.h"
+#include <xcb/xcb.h>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace xcb {
+
+// A cache of interned atoms, and of atom names.
+//
+// Interning a number of atoms is pipelined: all InternAtom requests are sent before the first reply is waited for,
+// so that it costs a single round trip. Names of atoms that were interned through the cache, or looked up before,
+// are returned without a round trip.
+class AtomCache
+{
+ private:
+  struct Maps
+  {
+    std::map<std::string, xcb_atom_t, std::less<>> m_name_to_atom;
+    std::map<xcb_atom_t, std::string> m_atom_to_name;
+
+    void insert(std::string_view name, xcb_atom_t atom);
+  };
+  using maps_t = threadsafe::Unlocked<Maps, threadsafe::policy::Primitive<std::mutex>>;
+
+  xcb_connection_t* m_connection = nullptr;
+  mutable maps_t m_maps;
+
+ public:
+  // Must be called after connecting and before any other member function.
+  void init(xcb_connection_t* connection) { m_connection = connection; }
+
+  // The state of a pipelined intern of a number of atoms.
+  class InternRequests
+  {
+   private:
+    friend class AtomCache;
+    std::vector<std::string_view> m_names;
+    std::vector<xcb_intern_atom_cookie_t> m_cookies;    // A sequence number of zero means that the atom was found in the cache.
+    std::vector<xcb_atom_t> m_atoms;
+    std::unique_ptr<AsyncReply[]> m_replies;            // The replies that are collected by poll_intern_replies.
+    size_t m_next_reply = 0;                            // The index of the next reply to collect.
+
+   public:
+    // The number of requests. Request i has sequence number sequence(i), which is zero if the atom was found in the cache.
+    size_t size() const { return m_cookies.size(); }
+    unsigned int sequence(size_t i) const { return m_cookies[i].sequence; }
+
+    // The object that receives the reply of request i; pass it to Connection::await_reply.
+    AsyncReply& reply(size_t i) { return m_replies[i]; }
+
+    // The interned atoms, in the order of the names that were passed to send_intern_requests.
+    // Only valid after poll_intern_replies returned true, or wait_for_intern_replies returned.
+    std::vector<xcb_atom_t> const& atoms() const { return m_atoms; }
+  };
+
+ private:
+  // Store the atom of the next reply. Throws if reply is nullptr (the request failed).
+  void store_reply(InternRequests& requests, xcb_intern_atom_reply_t const* reply);
+
+ public:
+  // Send InternAtom requests for those `names` that are not in the cache yet. Does not wait for the replies.
+  // The names must stay valid until all replies are collected.
+  void send_intern_requests(std::span<std::string_view const> names, InternRequests& requests);
+
+  // Collect the replies that arrived in requests.reply(i) (see Connection::await_reply), without blocking.
+  // Returns true when all replies were collected.
+  bool poll_intern_replies(InternRequests& requests);
+
+  // Collect all replies, blocking until they arrived.
+  void wait_for_intern_replies(InternRequests& requests);
+
+  // Intern all `names`, writing the corresponding atoms to `atoms_out` (which must have the same size).
+  // Names that are not in the cache yet are interned with a single round trip to the server.
+  void intern(std::span<std::string_view const> names, std::span<xcb_atom_t> atoms_out);
+
+  // Intern a single atom.
+  xcb_atom_t intern(std::string_view name)
+  {
+    xcb_atom_t atom;
+    intern({ &name, 1 }, { &atom, 1 });
+    return atom;
+  }
+
+  // Return the atom of `name` if it is in the cache, otherwise XCB_ATOM_NONE.
+  xcb_atom_t find(std::string_view name) const;
+
+  // Return the name of `atom`. Costs a round trip to the server if it is not in the cache.
+  // Returns an empty string if the atom does not exist.
+  std::string_view name(xcb_atom_t atom) const;
+};
+
+} // namespace xcb
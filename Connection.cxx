@@ -2,6 +2,10 @@
 #include "Connection.h"
 #include "Xkb.h"
 #include <X11/extensions/XKBproto.h>    // xkbAnyEvent
+#include <sys/socket.h>
+#include <bit>
+#include <cstring>
+#include <limits>
 #if CW_DEBUG
 #include "utils/popcount.h"
 #endif
@@ -21,6 +25,19 @@ namespace xcb {
 void Connection::connect(std::string display_name)
 {
   DoutEntering(dc::notice, "xcb::Connection::connect(\"" << display_name << "\")");
+  open(display_name);
+  send_atom_requests();
+  setup_xkb();
+  send_extension_queries();
+  create_keymap();
+  wait_for_extension_replies();
+  wait_for_atom_replies();
+  start_input();
+}
+
+void Connection::open(std::string const& display_name)
+{
+  DoutEntering(dc::notice, "xcb::Connection::open(\"" << display_name << "\")");
 
   using namespace xcb::errors;
   using namespace org::freedesktop::xcb;
@@ -33,30 +50,180 @@ void Connection::connect(std::string display_name)
     m_connection = nullptr;
     THROW_ALERTC(error, "xcb_connect");
   }
+  xcb_setup_t const* setup = xcb_get_setup(m_connection);
+  m_window_registry.init(setup->resource_id_base, setup->resource_id_mask);
+  m_screen = xcb_setup_roots_iterator(setup).data;
+  m_atom_cache.init(m_connection);
+  // The QueryExtension replies arrive while XKB is negotiated.
+  if (m_use_xinput)
+    xcb_prefetch_extension_data(m_connection, &xcb_input_id);
+  if (m_use_present)
+    xcb_prefetch_extension_data(m_connection, &xcb_present_id);
+  if (m_use_shm)
+    xcb_prefetch_extension_data(m_connection, &xcb_shm_id);
+}
+
+void Connection::send_atom_requests()
+{
+  // Intern all atoms that we need with a single round trip.
+  std::vector<std::string_view> atom_names = { "WM_PROTOCOLS", "WM_DELETE_WINDOW", "UTF8_STRING", "_NET_WM_NAME" };
+  atom_names.insert(atom_names.end(), m_registered_atom_names.begin(), m_registered_atom_names.end());
+  m_atom_cache.send_intern_requests(atom_names, m_atom_requests);
+}
+
+void Connection::setup_xkb()
+{
   m_xkb.init(m_connection);
-  m_screen = xcb_setup_roots_iterator(xcb_get_setup(m_connection)).data;
+}
+
+void Connection::create_keymap()
+{
+  m_xkb.create_keymap_and_state(m_connection);
+}
+
+void Connection::send_extension_queries()
+{
+  if (m_use_xinput &&
+      !XInput::send_queries(m_connection, m_extension_query_sequences[xinput_version], m_extension_query_sequences[xinput_devices]))
+    Dout(dc::warning, "XInput2 is not available.");
+  if (m_use_present)
+  {
+    xcb_query_extension_reply_t const* extension = xcb_get_extension_data(m_connection, &xcb_present_id);
+    if (!extension || !extension->present)
+      Dout(dc::warning, "The X server does not support the Present extension.");
+    else
+      m_extension_query_sequences[present_version] = xcb_present_query_version(m_connection, 1, 2).sequence;
+  }
+  if (m_use_shm)
+  {
+    // Shared memory only works if the server runs on the same machine, which is the case when we are connected through a unix socket.
+    sockaddr_storage address;
+    socklen_t address_length = sizeof(address);
+    xcb_query_extension_reply_t const* extension;
+    if (getsockname(xcb_get_file_descriptor(m_connection), reinterpret_cast<sockaddr*>(&address), &address_length) == -1 || address.ss_family != AF_UNIX)
+      Dout(dc::notice, "The X server is not local; not using MIT-SHM.");
+    else if (!(extension = xcb_get_extension_data(m_connection, &xcb_shm_id)) || !extension->present)
+      Dout(dc::warning, "The X server does not support the MIT-SHM extension.");
+    else
+      m_extension_query_sequences[shm_version] = xcb_shm_query_version(m_connection).sequence;
+  }
+  // Let the server process them while we download the keymap.
+  xcb_flush(m_connection);
+}
 
-  // Prepare notification for window destruction.
-  xcb_intern_atom_cookie_t  protocols_cookie = xcb_intern_atom(m_connection, 1, 12, "WM_PROTOCOLS");
-  xcb_intern_atom_reply_t*  protocols_reply  = xcb_intern_atom_reply(m_connection, protocols_cookie, 0);
-  m_wm_protocols_atom = protocols_reply->atom;
-  free(protocols_reply);
+void Connection::await_extension_replies(AIStatefulTask* task, AIStatefulTask::condition_type condition)
+{
+  for (int query = 0; query < number_of_extension_queries; ++query)
+    if (m_extension_query_sequences[query] != 0)
+      await_reply(m_extension_query_sequences[query], m_extension_replies[query], task, condition);
+}
 
-  xcb_intern_atom_cookie_t  delete_cookie    = xcb_intern_atom(m_connection, 0, 16, "WM_DELETE_WINDOW");
-  xcb_intern_atom_reply_t*  delete_reply     = xcb_intern_atom_reply(m_connection, delete_cookie, 0);
-  m_wm_delete_window_atom = delete_reply->atom;
-  free(delete_reply);
+bool Connection::poll_extension_replies()
+{
+  for (int query = 0; query < number_of_extension_queries; ++query)
+    if (m_extension_query_sequences[query] != 0 && !m_extension_replies[query].ready())
+      return false;
+  process_extension_replies();
+  return true;
+}
 
-  xcb_intern_atom_cookie_t  utf8_string_cookie = xcb_intern_atom(m_connection, 0, 11, "UTF8_STRING");
-  xcb_intern_atom_reply_t*  utf8_string_reply  = xcb_intern_atom_reply(m_connection, utf8_string_cookie, 0);
-  m_utf8_string_atom = utf8_string_reply->atom;
-  free(utf8_string_reply);
+void Connection::wait_for_extension_replies()
+{
+  for (int query = 0; query < number_of_extension_queries; ++query)
+    if (m_extension_query_sequences[query] != 0)
+      PendingReplies::wait_for(m_connection, m_extension_query_sequences[query], m_extension_replies[query]);
+  process_extension_replies();
+}
 
-  xcb_intern_atom_cookie_t  net_wm_name_cookie = xcb_intern_atom(m_connection, 0, 12, "_NET_WM_NAME");
-  xcb_intern_atom_reply_t*  net_wm_name_reply  = xcb_intern_atom_reply(m_connection, net_wm_name_cookie, 0);
-  m_net_wm_name_atom = net_wm_name_reply->atom;
-  free(net_wm_name_reply);
+void Connection::process_extension_replies()
+{
+  if (m_extension_query_sequences[xinput_version] != 0 &&
+      !m_xinput.init(m_connection, m_screen->root,
+        m_extension_replies[xinput_version].get<xcb_input_xi_query_version_reply_t>(),
+        m_extension_replies[xinput_devices].get<xcb_input_xi_query_device_reply_t>()))
+    Dout(dc::warning, "XInput2 is not available.");
+  if (auto const* version = m_extension_replies[present_version].get<xcb_present_query_version_reply_t>())
+  {
+    Dout(dc::notice, "Using Present " << version->major_version << '.' << version->minor_version << '.');
+    m_present_opcode.store(xcb_get_extension_data(m_connection, &xcb_present_id)->major_opcode, std::memory_order_relaxed);
+  }
+  if (auto const* version = m_extension_replies[shm_version].get<xcb_shm_query_version_reply_t>())
+  {
+    Dout(dc::notice, "Using MIT-SHM " << version->major_version << '.' << version->minor_version << '.');
+    m_shm_fd_passing.store(version->major_version > 1 || (version->major_version == 1 && version->minor_version >= 2), std::memory_order_relaxed);
+    m_shm_first_event.store(xcb_get_extension_data(m_connection, &xcb_shm_id)->first_event, std::memory_order_relaxed);
+  }
+  for (AsyncReply& reply : m_extension_replies)
+    reply.reset();
+  m_extension_query_sequences = {};
+}
+
+void Connection::select_xinput_events(xcb_window_t handle, bool raw_motion)
+{
+  DoutEntering(dc::notice, "xcb::Connection::select_xinput_events(" << handle << ", " << std::boolalpha << raw_motion << ")");
+  if (!has_xinput())
+    return;
+  XInput::select_events(m_connection, handle, XCB_INPUT_XI_EVENT_MASK_MOTION);
+  // Raw events are only delivered to the root window. This replaces the mask that was selected by XInput::init.
+  if (raw_motion && !m_raw_motion_selected.exchange(true, std::memory_order_relaxed))
+    XInput::select_events(m_connection, m_screen->root, XCB_INPUT_XI_EVENT_MASK_DEVICE_CHANGED | XCB_INPUT_XI_EVENT_MASK_RAW_MOTION);
+  mark_dirty();
+}
+
+void Connection::select_present_events(xcb_window_t handle)
+{
+  DoutEntering(dc::notice, "xcb::Connection::select_present_events(" << handle << ")");
+  if (!has_present())
+    return;
+  // The selection is destroyed together with the window.
+  xcb_present_select_input(m_connection, xcb_generate_id(m_connection), handle, XCB_PRESENT_EVENT_MASK_COMPLETE_NOTIFY | XCB_PRESENT_EVENT_MASK_IDLE_NOTIFY);
+  mark_dirty();
+}
+
+void Connection::register_shm_buffer(xcb_shm_seg_t segment, ShmBuffer* buffer)
+{
+  std::lock_guard<std::mutex> lock(m_shm_buffers_mutex);
+  m_shm_buffers.emplace(segment, buffer);
+}
 
+void Connection::unregister_shm_buffer(xcb_shm_seg_t segment)
+{
+  std::lock_guard<std::mutex> lock(m_shm_buffers_mutex);
+  m_shm_buffers.erase(segment);
+}
+
+void Connection::store_atoms()
+{
+  auto const& atoms = m_atom_requests.atoms();
+  m_wm_protocols_atom = atoms[0];       // Used for notification of window destruction.
+  m_wm_delete_window_atom = atoms[1];
+  m_utf8_string_atom = atoms[2];
+  m_net_wm_name_atom = atoms[3];
+}
+
+void Connection::await_atom_replies(AIStatefulTask* task, AIStatefulTask::condition_type condition)
+{
+  for (size_t i = 0; i < m_atom_requests.size(); ++i)
+    if (m_atom_requests.sequence(i) != 0)
+      await_reply(m_atom_requests.sequence(i), m_atom_requests.reply(i), task, condition);
+}
+
+bool Connection::poll_atom_replies()
+{
+  if (!m_atom_cache.poll_intern_replies(m_atom_requests))
+    return false;
+  store_atoms();
+  return true;
+}
+
+void Connection::wait_for_atom_replies()
+{
+  m_atom_cache.wait_for_intern_replies(m_atom_requests);
+  store_atoms();
+}
+
+void Connection::start_input()
+{
   int fd = xcb_get_file_descriptor(m_connection);
   fd_init(fd);
 
@@ -65,10 +232,26 @@ void Connection::connect(std::string display_name)
   start_input_device();
 }
 
+void Connection::register_atoms(std::span<std::string_view const> names)
+{
+  // Must be called before connect.
+  ASSERT(!m_connection);
+  m_registered_atom_names.insert(m_registered_atom_names.end(), names.begin(), names.end());
+}
+
 void Connection::close()
 {
   DoutEntering(dc::notice, "xcb::Connection::close()");
 
+  if (m_event_dispatcher)
+  {
+    m_event_dispatcher->stop();
+    m_event_dispatcher.reset();
+  }
+  m_pending_replies.clear();
+  for (auto& pending_xkb_state : m_pending_xkb_states)
+    if (xkb_state* state = pending_xkb_state.exchange(nullptr, std::memory_order_acquire))
+      Xkb::discard_state(state);
   FileDescriptor::close();
   if (m_connection)
   {
@@ -80,77 +263,99 @@ void Connection::close()
 void Connection::add(xcb_window_t handle, WindowBase* window)
 {
   Dout(dc::xcb, "Connection::add(" << handle << ", " << window << ")");
-  handle_to_window_map_t::wat handle_to_window_map_w(m_handle_to_window_map);
-  handle_to_window_map_w->emplace(handle_to_window_map_container_t::value_type{handle, window});
+  m_window_registry.add(handle, window, window->batches_input_events());
 }
 
 void Connection::destroyed(xcb_window_t handle)
 {
   Dout(dc::xcb, "Connection::destroyed(" << handle << ")");
-  handle_to_window_map_t::wat handle_to_window_map_w(m_handle_to_window_map);
-  auto iter = handle_to_window_map_w->find(handle);
-  // Can this ever happen?
-  ASSERT(iter != handle_to_window_map_w->end());
-  iter->second = nullptr;
+  m_window_registry.destroyed(handle);
 }
 
 bool Connection::remove(xcb_window_t handle)
 {
   Dout(dc::xcb, "Connection::remove(" << handle << ")");
-  handle_to_window_map_t::wat handle_to_window_map_w(m_handle_to_window_map);
-  handle_to_window_map_w->erase(handle);
-  return handle_to_window_map_w->empty();
+  return m_window_registry.remove(handle);
 }
 
-WindowBase* Connection::lookup(xcb_window_t handle) const
+//static
+void Connection::throw_no_such_window(xcb_window_t handle)
 {
-  handle_to_window_map_t::crat handle_to_window_map_r(m_handle_to_window_map);
-  auto search = handle_to_window_map_r->find(handle);
-  if (AI_UNLIKELY(search == handle_to_window_map_r->end()))
-    THROW_ALERT("No such xcb window handle: [HANDLE]", AIArgs("[HANDLE]", handle));
-  return search->second;
+  THROW_ALERT("No such xcb window handle: [HANDLE]", AIArgs("[HANDLE]", handle));
 }
 
 xcb_void_cookie_t Connection::create_window(xcb_window_t handle, xcb_window_t parent_handle,
     int16_t x, int16_t y, uint16_t width, uint16_t height,
     std::u8string instance_name, std::u8string const& class_name, std::u8string const& title,
-    uint16_t border_width, uint16_t _class, uint32_t value_mask, std::vector<uint32_t> const& value_list) const
+    uint16_t border_width, uint16_t _class, uint32_t value_mask, std::vector<uint32_t> const& value_list)
 {
-  DoutEntering(dc::notice, "xcb::Connection::create_window(" << handle << ", " << parent_handle << ", " <<
-      x << ", " << y << ", " << width << ", " << height << ", \"" << title << "\", " <<
-      border_width << ", " << _class << ", 0x" << std::hex << value_mask << std::dec << ", " << value_list << ")");
+  WindowDescription const window{ handle, parent_handle, x, y, width, height,
+    instance_name, class_name, title, border_width, _class, value_mask, value_list };
+  WindowCookies cookies;
+  create_windows({ &window, 1 }, { &cookies, 1 });
+  return cookies.create_window;
+}
+
+void Connection::create_windows(std::span<WindowDescription const> windows, std::span<WindowCookies> cookies_out)
+{
+  DoutEntering(dc::notice, "xcb::Connection::create_windows(" << windows.size() << " windows)");
+  ASSERT(windows.size() == cookies_out.size());
+
+  // Use a single buffer for the WM_CLASS property of all windows.
+  size_t max_wm_class_size = 0;
+  for (WindowDescription const& window : windows)
+    max_wm_class_size = std::max(max_wm_class_size, window.instance_name.size() + window.class_name.size() + 2);
+  std::unique_ptr<char8_t[]> wm_class_buffer(new char8_t[max_wm_class_size]);
+
+  for (size_t i = 0; i < windows.size(); ++i)
+    cookies_out[i] = write_create_window_requests(windows[i], wm_class_buffer.get());
+
+  mark_dirty();
+}
+
+WindowCookies Connection::write_create_window_requests(WindowDescription const& window, char8_t* wm_class_buffer) const
+{
+  Dout(dc::notice, "Creating window " << window.handle << " (parent: " << window.parent_handle << ", " <<
+      window.x << ", " << window.y << ", " << window.width << ", " << window.height << ", \"" <<
+      std::u8string{window.title} << "\", " << window.border_width << ", " << window._class << ", 0x" <<
+      std::hex << window.value_mask << std::dec << ")");
 
   // value_list must have an entry for exactly each bit set in value_mask.
-  ASSERT(utils::popcount(value_mask) == value_list.size());
+  ASSERT(utils::popcount(window.value_mask) == window.value_list.size());
 
-  xcb_void_cookie_t ret = xcb_create_window(m_connection, XCB_COPY_FROM_PARENT, handle, parent_handle ? parent_handle : m_screen->root,
-      x, y, width, height,
-      border_width, _class, m_screen->root_visual, value_mask, value_list.data());
+  WindowCookies cookies;
+  cookies.create_window = xcb_create_window(m_connection, XCB_COPY_FROM_PARENT, window.handle,
+      window.parent_handle ? window.parent_handle : m_screen->root,
+      window.x, window.y, window.width, window.height,
+      window.border_width, window._class, m_screen->root_visual, window.value_mask, window.value_list.data());
 
   // Set window name.
-  xcb_change_property(m_connection, XCB_PROP_MODE_REPLACE, handle,
+  cookies.wm_name = xcb_change_property(m_connection, XCB_PROP_MODE_REPLACE, window.handle,
     XCB_ATOM_WM_NAME, m_utf8_string_atom, 8,
-    title.size(), title.data());
-  xcb_change_property(m_connection, XCB_PROP_MODE_REPLACE, handle,
+    window.title.size(), window.title.data());
+  cookies.net_wm_name = xcb_change_property(m_connection, XCB_PROP_MODE_REPLACE, window.handle,
     m_net_wm_name_atom, m_utf8_string_atom, 8,
-    title.size(), title.data());
+    window.title.size(), window.title.data());
 
-  ASSERT(!instance_name.empty() && !class_name.empty());
-  std::transform(instance_name.begin(), instance_name.end(), instance_name.begin(), [](char c){ return std::tolower(c); });
-  std::u8string instance_class = instance_name + u8'\0' + class_name + u8'\0';
+  ASSERT(!window.instance_name.empty() && !window.class_name.empty());
+  // WM_CLASS is the lowercased instance name and the class name, each terminated by a zero.
+  char8_t* out = std::transform(window.instance_name.begin(), window.instance_name.end(), wm_class_buffer,
+      [](char8_t c){ return static_cast<char8_t>(std::tolower(c)); });
+  *out++ = u8'\0';
+  out = std::copy(window.class_name.begin(), window.class_name.end(), out);
+  *out++ = u8'\0';
 
   // Set window instance and class.
-  xcb_change_property(m_connection, XCB_PROP_MODE_REPLACE, handle,
+  cookies.wm_class = xcb_change_property(m_connection, XCB_PROP_MODE_REPLACE, window.handle,
     XCB_ATOM_WM_CLASS, XCB_ATOM_STRING, 8,
-    instance_class.size(), instance_class.data());
+    out - wm_class_buffer, wm_class_buffer);
 
-  xcb_change_property(m_connection, XCB_PROP_MODE_REPLACE, handle, m_wm_protocols_atom, 4, 32, 1, &m_wm_delete_window_atom);
+  cookies.wm_protocols = xcb_change_property(m_connection, XCB_PROP_MODE_REPLACE, window.handle, m_wm_protocols_atom, 4, 32, 1, &m_wm_delete_window_atom);
 
   // Display window.
-  xcb_map_window(m_connection, handle);
-  xcb_flush(m_connection);
+  cookies.map_window = xcb_map_window(m_connection, window.handle);
 
-  return ret;
+  return cookies;
 }
 
 std::string ModifierMask::to_string() const
@@ -375,13 +580,7 @@ char const* Connection::response_type_to_string(uint8_t response_type) const
 
 std::string Connection::print_atom(xcb_atom_t atom) const
 {
-  xcb_get_atom_name_cookie_t atom_name_cookie = xcb_get_atom_name(m_connection, atom);
-  xcb_get_atom_name_reply_t* reply = xcb_get_atom_name_reply(m_connection, atom_name_cookie, nullptr);
-  if (!reply)
-    return {};
-  std::string atom_name_str(xcb_get_atom_name_name(reply), xcb_get_atom_name_name_length(reply));
-  free(reply);
-  return atom_name_str;
+  return std::string{m_atom_cache.name(atom)};
 }
 
 void Connection::print_on(std::ostream& os, xcb_generic_event_t const& event) const
@@ -599,6 +798,7 @@ void Connection::print_on(std::ostream& os, xcb_generic_event_t const& event) co
     case XCB_GE_GENERIC:
     {
       xcb_ge_generic_event_t const& ev = reinterpret_cast<xcb_ge_generic_event_t const&>(event);
+      os << ", extension:" << (int)ev.extension << ", event_type:" << ev.event_type << ", full_sequence:" << ev.full_sequence;
       break;
     }
     default:
@@ -648,21 +848,503 @@ void Connection::print_on(std::ostream& os, xcb_generic_event_t const& event) co
 }
 #endif
 
+namespace {
+
+uint16_t convert_modifiers(WindowBase* window, uint16_t modifiers)
+{
+  return modifiers ? window->convert(modifiers) : 0;
+}
+
+} // namespace
+
+bool Connection::dispatch(InputEvent const& input_event)
+{
+  if (AI_UNLIKELY(input_event.type == InputEvent::DestroyNotify))
+  {
+#ifdef CWDEBUG
+    WindowBase* window = lookup(input_event.window);
+    // destroyed should have been called before we can receive this message!
+    // This CAN happen for the child window of a window that is being closed, but it shouldn't
+    // happen because the program should close child windows before the parent window.
+    // We can't assert here however, because *theoretically* there is a race and even under
+    // normal circumstances it is theotretically possible that the call to destroyed got delayed.
+    Dout(dc::warning(window != nullptr), "Received a XCB_DESTROY_NOTIFY for a window for which destroyed() wasn't called yet?!");
+#endif
+    // Deliver collected events before the window is removed.
+    if (!m_batch.empty())
+      dispatch_batches();
+    if (m_number_of_text_inputs > 0)
+      dispatch_text_inputs();
+    return remove(input_event.window);
+  }
+
+  uintptr_t entry = find(input_event.window);
+  if (AI_UNLIKELY(entry == WindowRegistry::destroyed_window))
+  {
+    // The window can already be destroyed (an unmap is then the result of that).
+    Dout(dc::warning(input_event.type != InputEvent::UnmapNotify && input_event.type != InputEvent::FocusOut),
+        "Received " << response_type_to_string(input_event.type) << " for destroyed() window " << input_event.window);
+    return false;
+  }
+  WindowBase* window = WindowRegistry::window(entry);
+
+  if (input_event.type == InputEvent::TextInput)
+  {
+    // Collect the text per window.
+    auto text_input = std::find_if(m_text_inputs.begin(), m_text_inputs.begin() + m_number_of_text_inputs,
+        [&input_event](auto const& text_input){ return text_input.first == input_event.window; });
+    if (text_input == m_text_inputs.begin() + m_number_of_text_inputs)
+    {
+      if (m_number_of_text_inputs == m_text_inputs.size())
+        m_text_inputs.emplace_back();
+      text_input = m_text_inputs.begin() + m_number_of_text_inputs++;
+      text_input->first = input_event.window;
+    }
+    text_input->second.append(input_event.utf8, strnlen(input_event.utf8, sizeof(input_event.utf8)));
+    return false;
+  }
+
+  if ((entry & WindowRegistry::batched_input_events))
+  {
+    switch (input_event.type)
+    {
+      case InputEvent::MotionNotify:
+      case InputEvent::ButtonPress:
+      case InputEvent::ButtonRelease:
+      case InputEvent::KeyPress:
+      case InputEvent::KeyRelease:
+      case InputEvent::EnterNotify:
+      case InputEvent::LeaveNotify:
+      case InputEvent::FocusIn:
+      case InputEvent::FocusOut:
+      case InputEvent::PreciseMotion:
+      case InputEvent::RawMotion:
+      case InputEvent::Scroll:
+        m_batch.push_back(input_event);
+        return false;
+      default:
+        break;
+    }
+  }
+
+  event_latencies_t* event_latencies = m_active_event_latencies.load(std::memory_order_relaxed);
+  if (AI_LIKELY(!event_latencies))
+  {
+    call_handler(window, input_event);
+    return false;
+  }
+  auto const handler_start = std::chrono::steady_clock::now();
+  call_handler(window, input_event);
+  auto const handler_end = std::chrono::steady_clock::now();
+  EventLatency& event_latency = (*event_latencies)[input_event.type];
+  event_latency.handler.record(handler_end - handler_start);
+  event_latency.total.record(handler_end - input_event.time.readiness_time());
+  return false;
+}
+
+void Connection::call_handler(WindowBase* window, InputEvent const& input_event)
+{
+  switch (input_event.type)
+  {
+    case InputEvent::MotionNotify:
+      window->on_mouse_move(input_event.x, input_event.y, convert_modifiers(window, input_event.modifiers), input_event.time);
+      break;
+    case InputEvent::ButtonPress:
+    case InputEvent::ButtonRelease:
+      window->on_mouse_click(input_event.x, input_event.y, convert_modifiers(window, input_event.modifiers),
+          input_event.type == InputEvent::ButtonPress, input_event.button, input_event.time);
+      break;
+    case InputEvent::KeyPress:
+    case InputEvent::KeyRelease:
+      window->on_key_event(input_event.x, input_event.y, convert_modifiers(window, input_event.modifiers),
+          input_event.type == InputEvent::KeyPress, input_event.repeat, input_event.keysym, input_event.time);
+      break;
+    case InputEvent::EnterNotify:
+    case InputEvent::LeaveNotify:
+      window->on_mouse_enter(input_event.x, input_event.y, convert_modifiers(window, input_event.modifiers),
+          input_event.type == InputEvent::EnterNotify, input_event.time);
+      break;
+    case InputEvent::FocusIn:
+    case InputEvent::FocusOut:
+      window->on_focus_changed(input_event.type == InputEvent::FocusIn);
+      break;
+    case InputEvent::MapNotify:
+    case InputEvent::UnmapNotify:
+      window->on_map_changed(input_event.type == InputEvent::UnmapNotify);
+      break;
+    case InputEvent::ConfigureNotify:
+      window->on_window_size_changed(input_event.extent.width, input_event.extent.height);
+      break;
+    case InputEvent::DeleteWindow:
+      window->On_WM_DELETE_WINDOW(input_event.time.server_time);
+      break;
+    case InputEvent::PreciseMotion:
+      window->on_precise_mouse_move(input_event.precise_x(), input_event.precise_y(), convert_modifiers(window, input_event.modifiers), input_event.time);
+      break;
+    case InputEvent::RawMotion:
+      window->on_raw_motion(input_event.precise_x(), input_event.precise_y(), input_event.time);
+      break;
+    case InputEvent::Scroll:
+      window->on_scroll(input_event.precise_x(), input_event.precise_y(), convert_modifiers(window, input_event.modifiers), input_event.time);
+      break;
+    case InputEvent::EndOfPass:
+      // Handled by dispatch_event_ring.
+      break;
+    case InputEvent::DestroyNotify:
+    case InputEvent::TextInput:
+      // Handled by dispatch.
+      break;
+  }
+}
+
+void Connection::call_on_events(WindowBase* window, std::span<InputEvent const> events)
+{
+  event_latencies_t* event_latencies = m_active_event_latencies.load(std::memory_order_relaxed);
+  if (AI_LIKELY(!event_latencies))
+  {
+    window->on_events(events);
+    return;
+  }
+  auto const handler_start = std::chrono::steady_clock::now();
+  window->on_events(events);
+  auto const handler_end = std::chrono::steady_clock::now();
+  (*event_latencies)[0].handler.record(handler_end - handler_start);
+  for (InputEvent const& input_event : events)
+    (*event_latencies)[input_event.type].total.record(handler_end - input_event.time.readiness_time());
+}
+
+void Connection::dispatch_batches()
+{
+  // Usually all events are for the same window.
+  xcb_window_t const first_handle = m_batch.front().window;
+  if (std::all_of(m_batch.begin(), m_batch.end(), [first_handle](InputEvent const& input_event){ return input_event.window == first_handle; }))
+  {
+    if (WindowBase* window = lookup(first_handle))
+      call_on_events(window, m_batch);
+    m_batch.clear();
+    return;
+  }
+  // Make the events of each window contiguous, in the order of their first event.
+  for (InputEvent const& first : m_batch)
+  {
+    if (std::find(m_batched_windows.begin(), m_batched_windows.end(), first.window) != m_batched_windows.end())
+      continue;
+    m_batched_windows.push_back(first.window);
+    m_batch_scratch.clear();
+    std::copy_if(m_batch.begin(), m_batch.end(), std::back_inserter(m_batch_scratch),
+        [&first](InputEvent const& input_event){ return input_event.window == first.window; });
+    if (WindowBase* window = lookup(first.window))
+      call_on_events(window, m_batch_scratch);
+  }
+  m_batched_windows.clear();
+  m_batch.clear();
+}
+
+void Connection::dispatch_text_inputs()
+{
+  for (size_t i = 0; i < m_number_of_text_inputs; ++i)
+  {
+    auto& [handle, text] = m_text_inputs[i];
+    if (WindowBase* window = lookup(handle))
+      window->on_text_input(text);
+    text.clear();       // Keeps the capacity.
+  }
+  m_number_of_text_inputs = 0;
+}
+
+void Connection::dispatch_exposes()
+{
+  {
+    std::lock_guard<std::mutex> lock(m_exposes_mutex);
+    m_exposes_scratch.swap(m_exposes);
+    m_have_exposes.store(false, std::memory_order_relaxed);
+  }
+  for (auto const& [handle, region] : m_exposes_scratch)
+  {
+    // The window might already be removed.
+    uintptr_t entry = m_window_registry.find(handle);
+    if (entry != WindowRegistry::not_found && entry != WindowRegistry::destroyed_window)
+      WindowRegistry::window(entry)->on_expose(region);
+  }
+  m_exposes_scratch.clear();
+}
+
+void Connection::dispatch_present_events()
+{
+  {
+    std::lock_guard<std::mutex> lock(m_present_events_mutex);
+    m_present_events_scratch.swap(m_present_events);
+    m_have_present_events.store(false, std::memory_order_relaxed);
+  }
+  for (PresentEvent const& present_event : m_present_events_scratch)
+  {
+    // The window might already be removed.
+    uintptr_t entry = m_window_registry.find(present_event.window);
+    if (entry != WindowRegistry::not_found && entry != WindowRegistry::destroyed_window)
+      WindowRegistry::window(entry)->on_present(present_event);
+  }
+  m_present_events_scratch.clear();     // Keeps the capacity.
+}
+
+void Connection::dispatch_event_ring()
+{
+  InputEvent input_event;
+  while (m_event_ring->pop(input_event))
+  {
+    // Deliver the batches and the text of whole read_from_fd passes, even if the ring is drained in the middle of a pass.
+    if (input_event.type == InputEvent::EndOfPass)
+    {
+      if (!m_batch.empty())
+        dispatch_batches();
+      if (m_number_of_text_inputs > 0)
+        dispatch_text_inputs();
+      continue;
+    }
+    if (AI_UNLIKELY(dispatch(input_event)))
+      m_last_window_removed.store(true, std::memory_order_relaxed);
+  }
+  if (m_have_exposes.load(std::memory_order_relaxed))
+    dispatch_exposes();
+  if (m_have_present_events.load(std::memory_order_relaxed))
+    dispatch_present_events();
+  // Let read_from_fd continue if it stopped because the ring was full.
+  if (AI_UNLIKELY(m_event_ring_stalled.load(std::memory_order_relaxed)) && m_event_ring_stalled.exchange(false))
+    resume_reading();
+}
+
+bool Connection::deliver(InputEvent const& input_event)
+{
+  if (!m_event_ring)
+    return dispatch(input_event);
+  m_event_ring_needs_signal = true;
+  // Keep the order: once a record didn't fit, the records that follow it are queued behind it.
+  if (AI_UNLIKELY(!m_stalled_events.empty()))
+  {
+    m_stalled_events.push_back(input_event);
+    return false;
+  }
+  EventRing::PushResult const result = m_event_ring->push(input_event);
+  if (AI_UNLIKELY(result == EventRing::PushResult::full))
+  {
+    // Don't wait for the dispatcher on the evio thread: read_from_fd stops after the current event,
+    // and the dispatcher resumes it once it made room (see dispatch_event_ring).
+    m_stalled_events.push_back(input_event);
+    m_event_ring_stalled.store(true);
+    m_event_dispatcher->events_available();
+  }
+  // Wake up the dispatcher immediately when the high-water mark is reached.
+  else if (AI_UNLIKELY(result == EventRing::PushResult::wake_consumer))
+    m_event_dispatcher->events_available();
+  return false;
+}
+
+bool Connection::push_stalled_events()
+{
+  auto stalled_event = m_stalled_events.begin();
+  while (stalled_event != m_stalled_events.end() && m_event_ring->push(*stalled_event) != EventRing::PushResult::full)
+    ++stalled_event;
+  m_stalled_events.erase(m_stalled_events.begin(), stalled_event);
+  if (!m_stalled_events.empty())
+    m_event_ring_stalled.store(true);
+  m_event_dispatcher->events_available();
+  return m_stalled_events.empty();
+}
+
+void Connection::resume_reading()
+{
+  if (!m_resume_reading.exchange(true, std::memory_order_relaxed))
+    start_output_device();
+}
+
+void Connection::emit_text(InputEvent const& key_press)
+{
+  std::array<char, 64> text;
+  size_t length = m_xkb.text(key_press.keysym, text);
+  // Split the text over as many TextInput records as needed. Only split between characters,
+  // so that every record holds valid UTF-8 on its own.
+  InputEvent text_input = { .type = InputEvent::TextInput, .window = key_press.window, .x = key_press.x, .y = key_press.y, .time = key_press.time };
+  size_t chunk;
+  for (size_t offset = 0; offset < length; offset += chunk)
+  {
+    chunk = std::min(length - offset, sizeof(text_input.utf8));
+    // Don't start the next record with a continuation byte (10xxxxxx). A character has at most four bytes.
+    while (chunk > 1 && offset + chunk < length && (text[offset + chunk] & 0xc0) == 0x80)
+      --chunk;
+    std::memcpy(text_input.utf8, &text[offset], chunk);
+    std::memset(text_input.utf8 + chunk, 0, sizeof(text_input.utf8) - chunk);
+    emit(text_input);
+  }
+}
+
+void Connection::decode_present_event(xcb_ge_generic_event_t const* event, uint32_t poll_delay_ns, std::chrono::steady_clock::time_point receive_time)
+{
+  PresentEvent present_event;
+  switch (event->event_type)
+  {
+    case XCB_PRESENT_COMPLETE_NOTIFY:
+    {
+      xcb_present_complete_notify_event_t const* ev = reinterpret_cast<xcb_present_complete_notify_event_t const*>(event);
+      present_event = { .type = PresentEvent::Complete, .kind = ev->kind, .mode = ev->mode, .window = ev->window, .serial = ev->serial,
+        .pixmap = XCB_PIXMAP_NONE, .ust = ev->ust, .msc = ev->msc, .time = { XCB_CURRENT_TIME, poll_delay_ns, receive_time } };
+      break;
+    }
+    case XCB_PRESENT_IDLE_NOTIFY:
+    {
+      xcb_present_idle_notify_event_t const* ev = reinterpret_cast<xcb_present_idle_notify_event_t const*>(event);
+      present_event = { .type = PresentEvent::Idle, .window = ev->window, .serial = ev->serial,
+        .pixmap = ev->pixmap, .time = { XCB_CURRENT_TIME, poll_delay_ns, receive_time } };
+      break;
+    }
+    default:
+      return;
+  }
+  std::lock_guard<std::mutex> lock(m_present_events_mutex);
+  m_present_events.push_back(present_event);
+  m_have_present_events.store(true, std::memory_order_relaxed);
+  if (m_event_ring)
+    m_event_ring_needs_signal = true;
+}
+
+void Connection::decode_xinput_event(xcb_ge_generic_event_t const* event, uint32_t poll_delay_ns, std::chrono::steady_clock::time_point receive_time)
+{
+  InputEvent input_event;
+  switch (event->event_type)
+  {
+    case XCB_INPUT_MOTION:
+    {
+      xcb_input_motion_event_t const* ev = reinterpret_cast<xcb_input_motion_event_t const*>(event);
+      uint16_t const modifiers = XInput::modifiers(ev);
+      // A XI_Motion event can report a change of position, of the scroll valuators, or both.
+      if (XInput::moved(ev))
+      {
+        input_event = { .type = InputEvent::PreciseMotion, .modifiers = modifiers, .window = ev->event, .time = { ev->time, poll_delay_ns, receive_time } };
+        input_event.set_fixed(ev->event_x, ev->event_y);
+        emit(input_event);
+      }
+      double dx, dy;
+      if (m_xinput.scroll(ev, dx, dy))
+      {
+        input_event = { .type = InputEvent::Scroll, .modifiers = modifiers, .window = ev->event, .time = { ev->time, poll_delay_ns, receive_time } };
+        input_event.set_fixed(InputEvent::to_fixed(dx), InputEvent::to_fixed(dy));
+        emit(input_event);
+      }
+      break;
+    }
+    case XCB_INPUT_RAW_MOTION:
+    {
+      xcb_input_raw_motion_event_t const* ev = reinterpret_cast<xcb_input_raw_motion_event_t const*>(event);
+      double dx, dy;
+      // Raw events are not for a particular window; deliver them to the window that has the focus.
+      if (m_focus_window != XCB_WINDOW_NONE && XInput::raw_motion(ev, dx, dy))
+      {
+        input_event = { .type = InputEvent::RawMotion, .window = m_focus_window, .time = { ev->time, poll_delay_ns, receive_time } };
+        input_event.set_fixed(InputEvent::to_fixed(dx), InputEvent::to_fixed(dy));
+        emit(input_event);
+      }
+      break;
+    }
+    case XCB_INPUT_DEVICE_CHANGED:
+      m_xinput.device_changed(reinterpret_cast<xcb_input_device_changed_event_t const*>(event));
+      break;
+  }
+}
+
+void Connection::emit_expose(xcb_window_t handle, Region&& region)
+{
+  std::lock_guard<std::mutex> lock(m_exposes_mutex);
+  // Merge with a region of the same window that wasn't delivered yet.
+  auto expose = std::find_if(m_exposes.begin(), m_exposes.end(), [handle](auto const& expose){ return expose.first == handle; });
+  if (expose == m_exposes.end())
+    m_exposes.emplace_back(handle, std::move(region));
+  else
+    for (xcb_rectangle_t const& rectangle : region.rectangles())
+      expose->second.add(rectangle);
+  m_have_exposes.store(true, std::memory_order_relaxed);
+  if (m_event_ring)
+    m_event_ring_needs_signal = true;
+}
+
+bool Connection::emit(InputEvent const& input_event)
+{
+  if (m_have_pending_motion)
+  {
+    // Drop the pending motion event if it is followed by one for the same window and with the same modifier state.
+    if (input_event.type == InputEvent::MotionNotify && input_event.window == m_pending_motion.window && input_event.modifiers == m_pending_motion.modifiers)
+      m_coalesced_motion_events.fetch_add(1, std::memory_order_relaxed);
+    else
+      deliver(m_pending_motion);
+    m_have_pending_motion = false;
+  }
+  if (input_event.type == InputEvent::MotionNotify && m_coalesce_motion.load(std::memory_order_relaxed))
+  {
+    // Keep the event around until we know if a newer one follows.
+    m_pending_motion = input_event;
+    m_have_pending_motion = true;
+    return false;
+  }
+  return deliver(input_event);
+}
+
+void Connection::emit_resizes(std::chrono::steady_clock::time_point readiness_time)
+{
+  std::chrono::steady_clock::time_point const now = std::chrono::steady_clock::now();
+  uint32_t const poll_delay_ns = std::min(std::chrono::nanoseconds{now - readiness_time}.count(), std::chrono::nanoseconds::rep{UINT32_MAX});
+  for (auto const& [handle, extent] : m_pending_resizes)
+  {
+    // Only call on_window_size_changed when the extent differs from the last one that was passed for this window.
+    auto last_extent = m_last_extent.find(handle);
+    if (last_extent != m_last_extent.end() && last_extent->second == extent)
+      continue;
+    m_last_extent.insert_or_assign(handle, extent);
+    InputEvent input_event{ .type = InputEvent::ConfigureNotify, .window = handle, .time = { XCB_CURRENT_TIME, poll_delay_ns, now } };
+    input_event.extent = extent;
+    emit(input_event);
+  }
+  m_pending_resizes.clear();
+}
+
 void Connection::read_from_fd(int& allow_deletion_count, int fd)
 {
 #ifdef CWDEBUG
   // Delay DoutEntering, because we don't want to print anything for just a XCB_MOTION_NOTIFY when dc::xcbmotion is off.
   NAMESPACE_DEBUG::Indent entering_indent(0);
 #endif
+  // The time at which the socket became readable (or as close to it as we can get).
+  std::chrono::steady_clock::time_point const readiness_time = std::chrono::steady_clock::now();
   bool destroyed = false;
+  uint32_t const max_events = m_budget_max_events.load(std::memory_order_relaxed);
+  std::chrono::nanoseconds const max_time{m_budget_max_time.load(std::memory_order_relaxed)};
+  std::chrono::steady_clock::time_point const deadline =
+    max_time.count() == 0 ? std::chrono::steady_clock::time_point::max() : readiness_time + max_time;
+  uint32_t remaining_events = max_events == 0 ? std::numeric_limits<uint32_t>::max() : max_events;
+  bool budget_exhausted = false;
   xcb_generic_event_t const* event;
+  // Install keymaps that were loaded in the background.
+  if (AI_UNLIKELY(m_have_pending_xkb_states.load(std::memory_order_relaxed)))
+    install_pending_xkb_states();
+  // First push the records that didn't fit in the event ring during the previous pass.
+  if (AI_UNLIKELY(!m_stalled_events.empty()))
+  {
+    if (!push_stalled_events())
+      return;
+    Dout(dc::xcb, "The event ring has room again; resuming reading.");
+    start_input_device();
+  }
+  bool received = false;
+  uint32_t last_sequence = 0;           // The sequence number of the last request that the server processed.
   while ((event = xcb_poll_for_event(m_connection)))
   {
+    std::chrono::steady_clock::time_point const receive_time = std::chrono::steady_clock::now();
+    received = true;
+    last_sequence = event->full_sequence;
+    uint32_t const poll_delay_ns = std::min(std::chrono::nanoseconds{receive_time - readiness_time}.count(), std::chrono::nanoseconds::rep{UINT32_MAX});
     uint8_t const rt = event->response_type & 0x7f;
+    // Every event counts against the budget, including X errors: a flood of errors must not bypass it.
+    bool const last_of_budget = --remaining_events == 0 || receive_time >= deadline;
 #ifdef CWDEBUG
     if (rt == XCB_FOCUS_IN || rt == XCB_DESTROY_NOTIFY)
       m_debug_no_focus = false;
-    if (!m_debug_no_focus && rt != XCB_MAPPING_NOTIFY && (rt != m_xkb.opcode() || reinterpret_cast<xcb_xkb_state_notify_event_t const*>(event)->deviceID == m_xkb.device_id()))
+    if (!m_debug_no_focus && rt != XCB_MAPPING_NOTIFY && (rt != m_xkb.opcode() || m_xkb.device(reinterpret_cast<xcb_xkb_state_notify_event_t const*>(event)->deviceID)))
     {
       bool is_motion_notify_event = rt == XCB_MOTION_NOTIFY;
       if (entering_indent.M_indent == 0 && (DEBUGCHANNELS::dc::xcbmotion.is_on() || (DEBUGCHANNELS::dc::xcb.is_on() && !is_motion_notify_event)))
@@ -680,11 +1362,18 @@ void Connection::read_from_fd(int& allow_deletion_count, int fd)
     if (AI_UNLIKELY(event->response_type == 0))
     {
       xcb_generic_error_t const* error = reinterpret_cast<xcb_generic_error_t const*>(event);
-      Dout(dc::warning, "Received X11 error " << error->error_code);
+      if (!m_error_router.route(*error))
+        Dout(dc::warning, "Received X11 error " << protocol_error(*error) << " (" << (int)error->error_code << ") for sequence " << error->full_sequence);
       free(const_cast<xcb_generic_event_t*>(event));
+      if (AI_UNLIKELY(last_of_budget))
+      {
+        budget_exhausted = true;
+        break;
+      }
       continue;
     }
-    // Process events
+    // Decode events.
+    InputEvent input_event;
     switch (rt)
     {
         // Mouse button
@@ -695,44 +1384,26 @@ void Connection::read_from_fd(int& allow_deletion_count, int fd)
         xcb_button_press_event_t const* ev = reinterpret_cast<xcb_button_press_event_t const*>(event);
         bool pressed = rt == XCB_BUTTON_PRESS;
 
-        uint16_t modifiers = ev->state;
-        Dout(dc::xcb, print_modifiers(modifiers));
-
+        Dout(dc::xcb, print_modifiers(ev->state));
         Dout(dc::xcb, "Button " << (int)ev->detail << ' ' << (pressed ? "pressed" : "released") << " in window " << ev->event << ", at coordinates (" << ev->event_x << ", " << ev->event_y << ")");
-        WindowBase* window = lookup(ev->event);
-        if (AI_LIKELY(window))
-        {
-          uint16_t converted_modifiers = 0;
-          if (modifiers)
-            converted_modifiers = window->convert(modifiers);
-          // UNIX mouse buttons start at 1, but we use the convention to start at 0 (like glfw and imgui).
-          // This also allows to use it as an index into an array more naturally.
-          ASSERT(ev->detail > 0);
-          uint8_t button = ev->detail - 1;
-          window->on_mouse_click(ev->event_x, ev->event_y, converted_modifiers, pressed, button);
-        }
-        else
-          Dout(dc::warning, "Received " << (pressed ? "XCB_BUTTON_PRESS" : "XCB_BUTTON_RELEASE") << " for destroyed() window " << ev->event);
+
+        // UNIX mouse buttons start at 1, but we use the convention to start at 0 (like glfw and imgui).
+        // This also allows to use it as an index into an array more naturally.
+        ASSERT(ev->detail > 0);
+        input_event = { .type = static_cast<InputEvent::Type>(rt), .button = static_cast<uint8_t>(ev->detail - 1), .modifiers = ev->state,
+          .window = ev->event, .x = ev->event_x, .y = ev->event_y, .time = { ev->time, poll_delay_ns, receive_time } };
+        emit(input_event);
         break;
       }
         // Mouse movement
       case XCB_MOTION_NOTIFY:
       {
         xcb_motion_notify_event_t const* motion_event = reinterpret_cast<xcb_motion_notify_event_t const*>(event);
+        Dout(dc::xcbmotion, print_modifiers(motion_event->state));
 
-        uint16_t modifiers = motion_event->state;
-        Dout(dc::xcbmotion, print_modifiers(modifiers));
-
-        WindowBase* window = lookup(motion_event->event);
-        if (AI_LIKELY(window))
-        {
-          uint16_t converted_modifiers = 0;
-          if (modifiers)
-            converted_modifiers = window->convert(modifiers);
-          window->on_mouse_move(motion_event->event_x, motion_event->event_y, converted_modifiers);
-        }
-        else
-          Dout(dc::warning, "Received " << "XCB_MOTION_NOTIFY" << " for destroyed() window " << motion_event->event);
+        input_event = { .type = InputEvent::MotionNotify, .modifiers = motion_event->state,
+          .window = motion_event->event, .x = motion_event->event_x, .y = motion_event->event_y, .time = { motion_event->time, poll_delay_ns, receive_time } };
+        emit(input_event);
         break;
       }
         // Going in or out of focus.
@@ -741,15 +1412,19 @@ void Connection::read_from_fd(int& allow_deletion_count, int fd)
       {
         // xcb_focus_in_event_t is a typedef of xcb_focus_out_event_t.
         xcb_focus_out_event_t const* focus_event = reinterpret_cast<xcb_focus_out_event_t const*>(event);
-        bool in_focus = rt == XCB_FOCUS_IN;
 
-        WindowBase* window = lookup(focus_event->event);
-        if (window)
-          window->on_focus_changed(in_focus);
+        input_event = { .type = static_cast<InputEvent::Type>(rt), .window = focus_event->event, .time = { XCB_CURRENT_TIME, poll_delay_ns, receive_time } };
+        emit(input_event);
+        // Keys that are released while we don't have the focus don't generate a KeyRelease for us.
+        m_keys_down.reset();
+        if (rt == XCB_FOCUS_IN)
+          m_focus_window = focus_event->event;
+        else if (focus_event->event == m_focus_window)
+          m_focus_window = XCB_WINDOW_NONE;
 
 #ifdef CWDEBUG
         // I keep receiving XKB events even when out of focus. For now just suppress debug output.
-        m_debug_no_focus = !in_focus;
+        m_debug_no_focus = rt == XCB_FOCUS_OUT;
 #endif
         break;
       }
@@ -759,12 +1434,9 @@ void Connection::read_from_fd(int& allow_deletion_count, int fd)
       {
         // xcb_map_notify_event_t is a typedef of xcb_unmap_notify_event_t.
         xcb_unmap_notify_event_t const* unmap_event = reinterpret_cast<xcb_unmap_notify_event_t const*>(event);
-        bool minimized = rt == XCB_UNMAP_NOTIFY;
 
-        WindowBase* window = lookup(unmap_event->window);
-        // The window can already be destroyed (this unmap is then the result of that).
-        if (window)
-          window->on_map_changed(minimized);
+        input_event = { .type = static_cast<InputEvent::Type>(rt), .window = unmap_event->window, .time = { XCB_CURRENT_TIME, poll_delay_ns, receive_time } };
+        emit(input_event);
         break;
       }
         // Resize
@@ -772,16 +1444,39 @@ void Connection::read_from_fd(int& allow_deletion_count, int fd)
       {
         xcb_configure_notify_event_t const* configure_event = reinterpret_cast<xcb_configure_notify_event_t const*>(event);
 
-        // Only call on_window_size_changed when the extent differs from the last one that we received (and isn't zero).
-        // Since that could be for another window, this is not a guarantee that on_window_size_changed
-        // is only called when the extent of window actually changed. But at least it is some improvement.
-        if (((configure_event->width > 0) && (m_width != configure_event->width)) ||
-          ((configure_event->height > 0) && (m_height != configure_event->height)))
+        // Ignore zero extents.
+        if (configure_event->width == 0 || configure_event->height == 0)
+          break;
+
+        // Remember only the last extent per window; on_window_size_changed is called once per window at the end of this pass.
+        Extent extent{configure_event->width, configure_event->height};
+        auto pending = std::find_if(m_pending_resizes.begin(), m_pending_resizes.end(),
+            [configure_event](auto const& pending_resize){ return pending_resize.first == configure_event->window; });
+        if (pending == m_pending_resizes.end())
+          m_pending_resizes.emplace_back(configure_event->window, extent);
+        else
+          pending->second = extent;
+        break;
+      }
+        // Repaint
+      case XCB_EXPOSE:
+      {
+        xcb_expose_event_t const* expose_event = reinterpret_cast<xcb_expose_event_t const*>(event);
+
+        // Accumulate the rectangles of a series of Expose events; count is the number of events of the series that still follow.
+        auto pending = std::find_if(m_pending_exposes.begin(), m_pending_exposes.end(),
+            [expose_event](auto const& pending_expose){ return pending_expose.first == expose_event->window; });
+        if (pending == m_pending_exposes.end())
         {
-          WindowBase* window = lookup(configure_event->window);
-          window->on_window_size_changed(configure_event->width, configure_event->height);
-          m_width = configure_event->width;
-          m_height = configure_event->height;
+          m_pending_exposes.emplace_back();
+          pending = m_pending_exposes.end() - 1;
+          pending->first = expose_event->window;
+        }
+        pending->second.add({ static_cast<int16_t>(expose_event->x), static_cast<int16_t>(expose_event->y), expose_event->width, expose_event->height });
+        if (expose_event->count == 0)
+        {
+          emit_expose(pending->first, std::move(pending->second));
+          m_pending_exposes.erase(pending);
         }
         break;
       }
@@ -793,10 +1488,9 @@ void Connection::read_from_fd(int& allow_deletion_count, int fd)
             client_message_event->type == m_wm_protocols_atom &&
             client_message_event->data.data32[0] == m_wm_delete_window_atom)
         {
-          uint32_t timestamp = client_message_event->data.data32[1];
-          WindowBase* window = lookup(client_message_event->window);
-          if (AI_LIKELY(window))
-            window->On_WM_DELETE_WINDOW(timestamp);
+          input_event = { .type = InputEvent::DeleteWindow, .window = client_message_event->window,
+            .time = { client_message_event->data.data32[1], poll_delay_ns, receive_time } };
+          emit(input_event);
         }
         break;
       }
@@ -805,42 +1499,50 @@ void Connection::read_from_fd(int& allow_deletion_count, int fd)
       {
         // xcb_key_press_release_t is a typedef of xcb_key_press_event_t.
         xcb_key_press_event_t const* ev = reinterpret_cast<xcb_key_press_event_t const*>(event);
-        bool pressed = rt == XCB_KEY_PRESS;
 
         xcb_keycode_t code = ev->detail;
-        xkb_keysym_t keysym = m_xkb.get_one_sym(code);
+        Xkb::Key const& key = m_xkb.key(code);
+        xkb_keysym_t keysym = key.keysym;
         if (keysym < 128)
           Dout(dc::xcb|continued_cf, "Got character: '" << char2str(keysym) << "'");
         else
           Dout(dc::xcb|continued_cf, "Got symbol: " << std::hex << keysym << std::dec);
 
-        xkb_mod_mask_t active_mods = m_xkb.get_active_mods();
-        xkb_mod_mask_t consumed_mods = m_xkb.get_consumed_mods(code);
+        xkb_mod_mask_t active_mods = m_xkb.active_mods();
+        xkb_mod_mask_t consumed_mods = key.consumed_mods;
         Dout(dc::finish, std::setbase(2) << " with active_mods = " << active_mods << " and consumed_mods = " << consumed_mods << ".");
 
-        WindowBase* window = lookup(ev->event);
-        uint16_t converted_modifiers = 0;
-        uint16_t modifiers = active_mods & ~consumed_mods;
-        if (modifiers)
-          converted_modifiers = window->convert(active_mods & ~consumed_mods);
-        window->on_key_event(ev->event_x, ev->event_y, converted_modifiers, pressed, keysym);
+        input_event = { .type = static_cast<InputEvent::Type>(rt), .modifiers = static_cast<uint16_t>(active_mods & ~consumed_mods),
+          .window = ev->event, .x = ev->event_x, .y = ev->event_y, .time = { ev->time, poll_delay_ns, receive_time } };
+        input_event.keysym = keysym;
+        // With detectable auto-repeat the server doesn't send a KeyRelease for repeats, so a KeyPress of a key that is already down is a repeat.
+        if (rt == XCB_KEY_PRESS)
+        {
+          input_event.repeat = m_keys_down.test(code);
+          m_keys_down.set(code);
+        }
+        else
+          m_keys_down.reset(code);
+        emit(input_event);
+        // Key presses without Control or Alt also produce text.
+        if (rt == XCB_KEY_PRESS && !(input_event.modifiers & (XCB_MOD_MASK_CONTROL | XCB_MOD_MASK_1)))
+          emit_text(input_event);
         break;
       }
       case XCB_DESTROY_NOTIFY:
       {
         xcb_destroy_notify_event_t const* destroy_notify_event = reinterpret_cast<xcb_destroy_notify_event_t const*>(event);
-#ifdef CWDEBUG
-        WindowBase* window = lookup(destroy_notify_event->window);
-        // destroyed should have been called before we can receive this message!
-        // This CAN happen for the child window of a window that is being closed, but it shouldn't
-        // happen because the program should close child windows before the parent window.
-        // We can't assert here however, because *theoretically* there is a race and even under
-        // normal circumstances it is theotretically possible that the call to destroyed got delayed.
-        Dout(dc::warning(window != nullptr), "Received a XCB_DESTROY_NOTIFY for a window for which destroyed() wasn't called yet?!");
-#endif
-        if (remove(destroy_notify_event->window))
-          destroyed = true;
 
+        // Forget about the extent of this window.
+        m_last_extent.erase(destroy_notify_event->window);
+        if (destroy_notify_event->window == m_focus_window)
+          m_focus_window = XCB_WINDOW_NONE;
+        std::erase_if(m_pending_exposes, [destroy_notify_event](auto const& pending_expose){ return pending_expose.first == destroy_notify_event->window; });
+        std::erase_if(m_pending_resizes, [destroy_notify_event](auto const& pending_resize){ return pending_resize.first == destroy_notify_event->window; });
+
+        input_event = { .type = InputEvent::DestroyNotify, .window = destroy_notify_event->window, .time = { XCB_CURRENT_TIME, poll_delay_ns, receive_time } };
+        if (emit(input_event))
+          destroyed = true;
         break;
       }
       case XCB_ENTER_NOTIFY:
@@ -848,45 +1550,66 @@ void Connection::read_from_fd(int& allow_deletion_count, int fd)
       {
         // xcb_leave_notify_event_t is a typedef of xcb_enter_notify_event_t.
         xcb_enter_notify_event_t const* enter_notify_event = reinterpret_cast<xcb_enter_notify_event_t const*>(event);
-        bool entered = rt == XCB_ENTER_NOTIFY;
-
-        uint16_t modifiers = enter_notify_event->state;
-        Dout(dc::xcb, print_modifiers(modifiers));
-
-        WindowBase* window = lookup(enter_notify_event->event);
-        if (window)
-        {
-          uint16_t converted_modifiers = 0;
-          if (modifiers)
-            converted_modifiers = window->convert(modifiers);
-          window->on_mouse_enter(enter_notify_event->event_x, enter_notify_event->event_y, converted_modifiers, entered);
-        }
-        else
-          Dout(dc::warning, "Received " << (entered ? "XCB_ENTER_NOTIFY" : "XCB_LEAVE_NOTIFY") << " for destroyed() window " << enter_notify_event->event);
-
+        Dout(dc::xcb, print_modifiers(enter_notify_event->state));
+
+        input_event = { .type = static_cast<InputEvent::Type>(rt), .modifiers = enter_notify_event->state,
+          .window = enter_notify_event->event, .x = enter_notify_event->event_x, .y = enter_notify_event->event_y,
+          .time = { enter_notify_event->time, poll_delay_ns, receive_time } };
+        emit(input_event);
+        // The scroll valuators might have changed while the pointer was elsewhere.
+        if (rt == XCB_ENTER_NOTIFY && has_xinput())
+          m_xinput.reset_scroll_valuators();
         break;
       }
       case XCB_MAPPING_NOTIFY:
         // Ignore - handled in XCB_XKB_MAP_NOTIFY below.
         break;
+      case XCB_GE_GENERIC:
+      {
+        xcb_ge_generic_event_t const* ge_event = reinterpret_cast<xcb_ge_generic_event_t const*>(event);
+        if (has_xinput() && ge_event->extension == m_xinput.opcode())
+          decode_xinput_event(ge_event, poll_delay_ns, receive_time);
+        else if (has_present() && ge_event->extension == m_present_opcode.load(std::memory_order_relaxed))
+          decode_present_event(ge_event, poll_delay_ns, receive_time);
+        break;
+      }
       default:
       {
-        if (rt == m_xkb.opcode())
+        if (has_shm() && rt == m_shm_first_event.load(std::memory_order_relaxed) + XCB_SHM_COMPLETION)
+        {
+          // The server is done reading the buffer of a ShmPutImage.
+          xcb_shm_completion_event_t const* ev = reinterpret_cast<xcb_shm_completion_event_t const*>(event);
+          AIStatefulTask* waiter = nullptr;
+          AIStatefulTask::condition_type condition;
+          {
+            std::lock_guard<std::mutex> lock(m_shm_buffers_mutex);
+            auto shm_buffer = m_shm_buffers.find(ev->shmseg);
+            if (shm_buffer != m_shm_buffers.end())
+              waiter = shm_buffer->second->completed(condition);
+          }
+          // Signal without holding the lock; the task might put the buffer again (or destroy the ShmImage).
+          if (waiter)
+            waiter->signal(condition);
+        }
+        else if (rt == m_xkb.opcode())
         {
           xkbAnyEvent const* anyev = reinterpret_cast<xkbAnyEvent const*>(event);
-          if (anyev->deviceID == m_xkb.device_id())
+          Xkb::Device* device = m_xkb.device(anyev->deviceID);
+          if (device)
           {
             switch (anyev->xkbType)
             {
+              case XCB_XKB_NEW_KEYBOARD_NOTIFY:
               case XCB_XKB_MAP_NOTIFY:
               {
-                m_xkb.create_keymap_and_state(m_connection);
+                // Only reload the keymap of this device.
+                keymap_changed(anyev->deviceID);
                 break;
               }
               case XCB_XKB_STATE_NOTIFY:
               {
                 xcb_xkb_state_notify_event_t const* ev = reinterpret_cast<xcb_xkb_state_notify_event_t const*>(anyev);
-                m_xkb.update_state(ev);
+                device->update_state(ev);
                 break;
               }
             }
@@ -897,9 +1620,197 @@ void Connection::read_from_fd(int& allow_deletion_count, int fd)
     }
     free(const_cast<xcb_generic_event_t*>(event));
 
-    if (AI_UNLIKELY(destroyed))
+    // When dispatching from the event ring, the removal of the last window is detected by the dispatcher task.
+    if (AI_UNLIKELY(destroyed || (m_last_window_removed.load(std::memory_order_relaxed) && m_last_window_removed.exchange(false))))
+      break;
+
+    // Stop when the event ring is full; the remaining events stay in the queue of libxcb.
+    if (AI_UNLIKELY(!m_stalled_events.empty()))
+      break;
+
+    if (AI_UNLIKELY(last_of_budget))
+    {
+      budget_exhausted = true;
       break;
+    }
+  }
+  // Deliver the last motion event of the series.
+  if (m_have_pending_motion)
+  {
+    deliver(m_pending_motion);
+    m_have_pending_motion = false;
+  }
+  // Deliver the final extent of each window that was resized.
+  if (!m_pending_resizes.empty())
+    emit_resizes(readiness_time);
+  // Deliver the input events of windows that batch them (when dispatching from this thread).
+  if (!m_event_ring && !m_batch.empty())
+    dispatch_batches();
+  // Deliver the text that was typed (when dispatching from this thread).
+  if (!m_event_ring && m_number_of_text_inputs > 0)
+    dispatch_text_inputs();
+  // Deliver the exposed regions (when dispatching from this thread).
+  if (!m_event_ring && m_have_exposes.load(std::memory_order_relaxed))
+    dispatch_exposes();
+  // Deliver the Present events (when dispatching from this thread).
+  if (!m_event_ring && m_have_present_events.load(std::memory_order_relaxed))
+    dispatch_present_events();
+  // Mark the end of this pass and wake up the dispatcher task.
+  if (m_event_ring_needs_signal)
+  {
+    deliver({ .type = InputEvent::EndOfPass });
+    m_event_dispatcher->events_available();
+    m_event_ring_needs_signal = false;
+  }
+  // Don't read from the socket until the dispatcher made room; it calls resume_reading.
+  if (AI_UNLIKELY(!m_stalled_events.empty()))
+  {
+    Dout(dc::xcb, "The event ring is full; waiting for the dispatcher.");
+    stop_input_device();
+  }
+  // Registered requests that did not cause an error before last_sequence succeeded.
+  if (received)
+    m_error_router.retire(last_sequence);
+  // Wake up the tasks whose replies arrived.
+  m_pending_replies.poll_all(m_connection);
+  if (AI_UNLIKELY(budget_exhausted))
+  {
+    Dout(dc::xcb, "Dispatch budget exhausted; yielding to the event loop.");
+    m_budget_exhausted_count.fetch_add(1, std::memory_order_relaxed);
+    // Events that libxcb already read from the socket do not cause the fd to become readable again;
+    // let the event loop call read_from_fd again after it serviced the other devices.
+    resume_reading();
+  }
+}
+
+void Connection::write_to_fd(int& allow_deletion_count, int fd)
+{
+  DoutEntering(dc::xcb, "xcb::Connection::write_to_fd()");
+  // Stop before clearing m_dirty: a mark_dirty that happens after clearing it will restart the output device.
+  stop_output_device();
+  // Continue with the events that libxcb already read from the socket (see resume_reading).
+  if (m_resume_reading.exchange(false, std::memory_order_relaxed))
+    read_from_fd(allow_deletion_count, fd);
+  if (!m_dirty.exchange(false, std::memory_order_relaxed))
+    return;
+
+  uint64_t const written_before = xcb_total_written(m_connection);
+  std::chrono::steady_clock::time_point const start = std::chrono::steady_clock::now();
+  // We were called because the socket is writable, so this only blocks if there is more data than fits in the socket buffer.
+  int success = xcb_flush(m_connection);
+  std::chrono::steady_clock::duration const flush_time = std::chrono::steady_clock::now() - start;
+
+  m_flushes.fetch_add(1, std::memory_order_relaxed);
+  m_bytes_written.fetch_add(xcb_total_written(m_connection) - written_before, std::memory_order_relaxed);
+  if (AI_UNLIKELY(flush_time > slow_flush_threshold))
+  {
+    Dout(dc::xcb, "xcb_flush took " << std::chrono::duration_cast<std::chrono::microseconds>(flush_time).count() << " microseconds.");
+    m_slow_flushes.fetch_add(1, std::memory_order_relaxed);
   }
+  if (AI_UNLIKELY(success <= 0))
+    Dout(dc::warning, "xcb_flush failed: the connection is broken.");
+}
+
+void Connection::keymap_changed(uint8_t device_id)
+{
+  DoutEntering(dc::notice, "xcb::Connection::keymap_changed(" << (int)device_id << ")");
+  if (m_keymap_handler.undefined())
+  {
+    m_xkb.install_state(device_id, Xkb::fetch_state(m_connection, device_id));
+    return;
+  }
+  m_stale_keymaps[device_id / 64].fetch_or(uint64_t{1} << (device_id % 64), std::memory_order_relaxed);
+  // Start a loader task, unless one is already running; that one will load the keymap.
+  if (m_keymap_requests.fetch_add(1, std::memory_order_release) == 0)
+  {
+    auto loader = statefultask::create<task::XkbKeymapLoader>(boost::intrusive_ptr<Connection>(this) COMMA_CWDEBUG_ONLY(false));
+    loader->run(m_keymap_handler);
+  }
+}
+
+void Connection::track_keyboard(uint8_t device_id)
+{
+  DoutEntering(dc::notice, "xcb::Connection::track_keyboard(" << (int)device_id << ")");
+  // Errors are reported by read_from_fd.
+  Xkb::select_events(m_connection, device_id);
+  if (m_keymap_handler.undefined())
+  {
+    // We are not on the input thread; let read_from_fd install it.
+    publish_xkb_state(device_id, Xkb::fetch_state(m_connection, device_id));
+    return;
+  }
+  keymap_changed(device_id);
+}
+
+void Connection::publish_xkb_state(uint8_t device_id, xkb_state* state)
+{
+  // If read_from_fd didn't install the previous one yet, that one is superseded.
+  xkb_state* superseded = m_pending_xkb_states[device_id].exchange(state, std::memory_order_release);
+  if (superseded)
+    Xkb::discard_state(superseded);
+  m_have_pending_xkb_states.store(true, std::memory_order_release);
+  // Make read_from_fd run, so that it installs the new state.
+  xcb_discard_reply(m_connection, xcb_get_input_focus(m_connection).sequence);
+  mark_dirty();
+}
+
+void Connection::install_pending_xkb_states()
+{
+  m_have_pending_xkb_states.store(false, std::memory_order_relaxed);
+  for (int device_id = 0; device_id < 256; ++device_id)
+  {
+    xkb_state* state = m_pending_xkb_states[device_id].exchange(nullptr, std::memory_order_acquire);
+    if (state)
+    {
+      Dout(dc::notice, "Installing new keymap for device " << device_id << ".");
+      m_xkb.install_state(device_id, state);
+    }
+  }
+}
+
+void Connection::load_keymaps()
+{
+  DoutEntering(dc::notice, "xcb::Connection::load_keymaps()");
+  uint32_t requests;
+  do
+  {
+    // A server usually sends several MapNotify events for a single change; load each keymap once for all of them.
+    requests = m_keymap_requests.load(std::memory_order_acquire);
+    for (int word = 0; word < 4; ++word)
+    {
+      for (uint64_t stale = m_stale_keymaps[word].exchange(0, std::memory_order_relaxed); stale; stale &= stale - 1)
+      {
+        uint8_t device_id = word * 64 + std::countr_zero(stale);
+        try
+        {
+          publish_xkb_state(device_id, Xkb::fetch_state(m_connection, device_id));
+        }
+        catch (AIAlert::Error const& error)
+        {
+          Dout(dc::warning, "Failed to load keymap of device " << (int)device_id << ": " << error << "; keeping the old one.");
+        }
+      }
+    }
+  }
+  while (m_keymap_requests.fetch_sub(requests, std::memory_order_relaxed) != requests);
+}
+
+void Connection::enable_latency_histograms(bool enable)
+{
+  DoutEntering(dc::notice, "xcb::Connection::enable_latency_histograms(" << std::boolalpha << enable << ")");
+  if (enable && !m_event_latencies)
+    m_event_latencies = std::make_unique<event_latencies_t>();
+  m_active_event_latencies.store(enable ? m_event_latencies.get() : nullptr, std::memory_order_relaxed);
+}
+
+void Connection::set_event_dispatcher(AIQueueHandle handler, uint32_t depth, uint32_t high_water_mark, EventRing::OverflowPolicy overflow_policy)
+{
+  DoutEntering(dc::notice, "xcb::Connection::set_event_dispatcher(" << handler << ", " << depth << ", " << high_water_mark << ", " << static_cast<int>(overflow_policy) << ")");
+  // Must be called before connect.
+  ASSERT(!m_connection && !m_event_ring);
+  m_event_ring = std::make_unique<EventRing>(depth, high_water_mark, overflow_policy);
+  m_event_dispatcher = statefultask::create<task::XcbEventDispatcher>(boost::intrusive_ptr<Connection>(this) COMMA_CWDEBUG_ONLY(false));
+  m_event_dispatcher->run(handler);
 }
 
 } // namespace xcb
@@ -1,13 +1,33 @@
 #pragma once
 
 #include "WindowBase.h"
+#include "AtomCache.h"
+#include "ErrorRouter.h"
+#include "PendingReplies.h"
 #include "evio/RawInputDevice.h"
 #include "evio/RawOutputDevice.h"
 #include "org.freedesktop.Xcb.Error/Errors.h"
-#include "threadsafe/threadsafe.h"
-#include "threadsafe/AIReadWriteSpinLock.h"
+#include "org.freedesktop.Xcb.Error/ProtocolErrors.h"
+#include "WindowRegistry.h"
+#include "InputEvent.h"
+#include "EventRing.h"
+#include "LatencyHistogram.h"
+#include "XcbEventDispatcher.h"
+#include "XkbKeymapLoader.h"
 #include "Xkb.h"
+#include "Region.h"
+#include "XInput.h"
+#include "ShmImage.h"
+#include "threadpool/AIQueueHandle.h"
 #include <xcb/xcb.h>
+#include <array>
+#include <atomic>
+#include <bitset>
+#include <chrono>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <span>
 #include <string>
 #include <string_view>
 #include <vector>
@@ -15,34 +35,200 @@
 
 namespace xcb {
 
-class Connection : public evio::RawInputDevice
+// The parameters of one window, for Connection::create_windows.
+struct WindowDescription
+{
+  xcb_window_t handle;                  // The ID returned by generate_id.
+  xcb_window_t parent_handle;           // Zero for a child of the root window.
+  int16_t x;
+  int16_t y;
+  uint16_t width;
+  uint16_t height;
+  std::u8string_view instance_name;     // Converted to lower case for WM_CLASS.
+  std::u8string_view class_name;
+  std::u8string_view title;
+  uint16_t border_width;
+  uint16_t _class;
+  uint32_t value_mask;
+  std::span<uint32_t const> value_list; // Must have an entry for exactly each bit set in value_mask.
+};
+
+// The cookies of the requests that Connection::create_windows writes for one window, in the order that they are sent.
+struct WindowCookies
+{
+  xcb_void_cookie_t create_window;
+  xcb_void_cookie_t wm_name;
+  xcb_void_cookie_t net_wm_name;
+  xcb_void_cookie_t wm_class;
+  xcb_void_cookie_t wm_protocols;
+  xcb_void_cookie_t map_window;
+};
+
+class Connection : public evio::RawInputDevice, public evio::RawOutputDevice
 {
  private:
   xcb_connection_t* m_connection = nullptr;
   xcb_screen_t* m_screen = nullptr;
-  xcb_atom_t m_wm_protocols_atom;
-  xcb_atom_t m_wm_delete_window_atom;
-  xcb_atom_t m_utf8_string_atom;
-  xcb_atom_t m_net_wm_name_atom;
-  uint16_t m_width = 0;                         // The width/height of the last XCB_CONFIGURE_NOTIFY that was received.
-  uint16_t m_height = 0;                        // That can be for any window, but since resizing usually happens for
-                                                // one window at a time it can still be used to improve performance a
-                                                // tiny bit.
+  xcb_atom_t m_wm_protocols_atom = XCB_ATOM_NONE;       // The atoms are XCB_ATOM_NONE until the replies of send_atom_requests were collected.
+  xcb_atom_t m_wm_delete_window_atom = XCB_ATOM_NONE;
+  xcb_atom_t m_utf8_string_atom = XCB_ATOM_NONE;
+  xcb_atom_t m_net_wm_name_atom = XCB_ATOM_NONE;
+  AtomCache m_atom_cache;
+  std::vector<std::string> m_registered_atom_names;     // Atoms that must be interned by connect (see register_atoms).
+  ErrorRouter m_error_router;
+  PendingReplies m_pending_replies;
+  AtomCache::InternRequests m_atom_requests;            // The atoms that are interned while connecting.
   Xkb m_xkb;
+  XInput m_xinput;
+  bool m_use_xinput = false;                            // Set if XInput2 must be negotiated while connecting (see set_use_xinput).
+  std::atomic<bool> m_raw_motion_selected = false;      // Set once XI_RawMotion events were selected on the root window.
+  std::atomic<uint8_t> m_present_opcode = 0;            // The major opcode of the Present extension; zero if it is not used.
+  bool m_use_present = false;                           // Set if the Present extension must be negotiated while connecting (see set_use_present).
+  bool m_use_shm = false;                               // Set if MIT-SHM must be negotiated while connecting (see set_use_shm).
+  std::atomic<bool> m_shm_fd_passing = false;           // Set if the server supports MIT-SHM 1.2 (ShmAttachFd).
+  std::atomic<uint8_t> m_shm_first_event = 0;           // The event base of MIT-SHM; zero if shared memory is not used.
+  // The requests that negotiate XInput2, Present and MIT-SHM (see send_extension_queries).
+  enum ExtensionQuery { xinput_version, xinput_devices, present_version, shm_version, number_of_extension_queries };
+  std::array<unsigned int, number_of_extension_queries> m_extension_query_sequences = {};      // Zero if the request wasn't sent.
+  std::array<AsyncReply, number_of_extension_queries> m_extension_replies;
+  std::mutex m_shm_buffers_mutex;                       // Protects m_shm_buffers.
+  std::map<xcb_shm_seg_t, ShmBuffer*> m_shm_buffers;    // The attached segments of all ShmImage objects of this connection.
+  AIQueueHandle m_keymap_handler;                       // The thread pool queue on which keymaps are loaded (see set_keymap_handler).
+  std::atomic<uint32_t> m_keymap_requests = 0;          // The number of keymap changes that weren't handled yet by load_keymaps.
+  std::array<std::atomic<uint64_t>, 4> m_stale_keymaps = {};    // Bit mask of the device IDs whose keymap must be loaded by load_keymaps.
+  std::array<std::atomic<xkb_state*>, 256> m_pending_xkb_states = {};   // Newly loaded states (and keymaps), per device ID, that read_from_fd must install.
+  std::atomic<bool> m_have_pending_xkb_states = false;  // Set when one of the m_pending_xkb_states might be non-null.
+  std::atomic<bool> m_coalesce_motion = false;          // Set if only the last of a series of queued XCB_MOTION_NOTIFY events (with the same window and state) must be delivered.
+  std::atomic<uint64_t> m_coalesced_motion_events = 0;  // The number of XCB_MOTION_NOTIFY events that were dropped because of that.
+  std::atomic<uint32_t> m_budget_max_events = 0;        // The maximum number of events processed per read_from_fd call, or zero if there is no limit.
+  std::atomic<std::chrono::nanoseconds::rep> m_budget_max_time = 0;     // The maximum time spent per read_from_fd call, or zero if there is no limit.
+  std::atomic<uint64_t> m_budget_exhausted_count = 0;   // The number of times that read_from_fd returned because the budget ran out.
+  std::atomic<bool> m_dirty = false;                    // Set when requests were issued that still need to be flushed (see mark_dirty).
+  std::atomic<bool> m_resume_reading = false;           // Set when write_to_fd must call read_from_fd (see resume_reading).
+  std::atomic<uint64_t> m_flushes = 0;                  // The number of flushes done by write_to_fd.
+  std::atomic<uint64_t> m_bytes_written = 0;            // The number of bytes written by those flushes.
+  std::atomic<uint64_t> m_slow_flushes = 0;             // The number of those flushes that took longer than slow_flush_threshold.
+
+  // The wall-clock time above which a flush is counted as slow. This includes waiting for the socket to drain,
+  // but also the thread being preempted during the flush.
+  static constexpr std::chrono::microseconds slow_flush_threshold{500};
 
-  using handle_to_window_map_container_t = std::map<xcb_window_t, WindowBase*>;
-  using handle_to_window_map_t = threadsafe::Unlocked<handle_to_window_map_container_t, threadsafe::policy::ReadWrite<AIReadWriteSpinLock>>;
+  // The following members are only accessed by read_from_fd.
+  std::map<xcb_window_t, Extent> m_last_extent;                         // The extent last passed to on_window_size_changed, per window.
+  std::vector<std::pair<xcb_window_t, Extent>> m_pending_resizes;       // The last extent of each window that received a XCB_CONFIGURE_NOTIFY during the current read_from_fd pass.
+  std::vector<std::pair<xcb_window_t, Region>> m_pending_exposes;       // The exposed areas of each window whose series of XCB_EXPOSE events isn't complete yet.
+  InputEvent m_pending_motion;                                          // The last motion event, if m_have_pending_motion is set.
+  bool m_have_pending_motion = false;
+  bool m_event_ring_needs_signal = false;                               // Set when events were pushed into m_event_ring during the current read_from_fd pass.
+  std::vector<InputEvent> m_stalled_events;                             // Records that didn't fit in m_event_ring, in order; pushed first by the next read_from_fd.
+  std::bitset<256> m_keys_down;                                         // The keycodes of the keys that are currently held down.
+  xcb_window_t m_focus_window = XCB_WINDOW_NONE;                        // The window that has the keyboard focus, if any; it receives the raw motion events.
 
-  handle_to_window_map_t m_handle_to_window_map;
+  // The following members are only accessed by the thread that calls dispatch.
+  std::vector<InputEvent> m_batch;                                      // Input events for windows that batch them, in arrival order.
+  std::vector<InputEvent> m_batch_scratch;                              // Used to make the events of one window contiguous.
+  std::vector<xcb_window_t> m_batched_windows;                          // The windows for which on_events was already called.
+  std::vector<std::pair<xcb_window_t, std::string>> m_text_inputs;      // The text typed per window during the current pass; the strings are reused.
+  size_t m_number_of_text_inputs = 0;                                   // The number of entries of m_text_inputs that are in use.
+  std::vector<PresentEvent> m_present_events_scratch;                   // The Present events that are being delivered.
+  std::vector<std::pair<xcb_window_t, Region>> m_exposes_scratch;       // The exposed regions that are being delivered.
+
+  // Present events are passed from read_from_fd to the thread that calls dispatch through this queue.
+  std::mutex m_present_events_mutex;
+  std::vector<PresentEvent> m_present_events;                           // Protected by m_present_events_mutex.
+  std::atomic<bool> m_have_present_events = false;                      // Set when m_present_events might be non-empty.
+
+  // The merged region of each completed series of Expose events is passed in one piece through this queue.
+  std::mutex m_exposes_mutex;
+  std::vector<std::pair<xcb_window_t, Region>> m_exposes;               // Protected by m_exposes_mutex; one entry per window.
+  std::atomic<bool> m_have_exposes = false;                             // Set when m_exposes might be non-empty.
+
+  WindowRegistry m_window_registry;
+
+  // Latency instrumentation (see enable_latency_histograms).
+  using event_latencies_t = std::array<EventLatency, InputEvent::number_of_types>;
+  std::unique_ptr<event_latencies_t> m_event_latencies;                 // Allocated by the first call to enable_latency_histograms.
+  std::atomic<event_latencies_t*> m_active_event_latencies = nullptr;   // Equal to m_event_latencies.get() while enabled, otherwise nullptr.
+
+  // Off-thread dispatching (see set_event_dispatcher).
+  std::unique_ptr<EventRing> m_event_ring;
+  boost::intrusive_ptr<task::XcbEventDispatcher> m_event_dispatcher;
+  std::atomic<bool> m_last_window_removed = false;     // Set by dispatch_event_ring when a DestroyNotify removed the last window.
+  std::atomic<bool> m_event_ring_stalled = false;      // Set while read_from_fd waits for the dispatcher to make room in m_event_ring.
 
 #ifdef CWDEBUG
   bool m_debug_no_focus = false;
 #endif
 
  public:
+  // Call the WindowBase callbacks from a task::XcbEventDispatcher running on handler, instead of from the input thread.
+  //
+  // The input thread then only decodes events into an EventRing that can hold at least `depth` records.
+  // The dispatcher task is woken up at the end of every read_from_fd pass, or as soon as the ring holds
+  // at least `high_water_mark` records. The overflow_policy determines what happens when the ring is full:
+  // read_from_fd never waits for the dispatcher, but stops reading until the dispatcher made room.
+  // Must be called before connect.
+  void set_event_dispatcher(AIQueueHandle handler, uint32_t depth, uint32_t high_water_mark, EventRing::OverflowPolicy overflow_policy);
+
+  // Download and compile new keymaps (after a XKB MapNotify) on handler, instead of on the input thread.
+  // Until the new keymap is ready the old one stays in use. Must be called before connect.
+  void set_keymap_handler(AIQueueHandle handler)
+  {
+    m_keymap_handler = handler;
+  }
+
+  // Negotiate XInput2 while connecting. This is optional: if the server doesn't support it (see has_xinput)
+  // select_xinput_events does nothing. Must be called before connect.
+  void set_use_xinput(bool use_xinput)
+  {
+    m_use_xinput = use_xinput;
+  }
+
+  // Negotiate the Present extension while connecting. This is optional: if the server doesn't support it (see has_present)
+  // select_present_events does nothing. Must be called before connect.
+  void set_use_present(bool use_present)
+  {
+    m_use_present = use_present;
+  }
+
+  // Negotiate MIT-SHM while connecting, for ShmImage. Shared memory is only used if the server runs on this machine
+  // (see has_shm); otherwise ShmImage falls back to PutImage. Must be called before connect.
+  void set_use_shm(bool use_shm)
+  {
+    m_use_shm = use_shm;
+  }
+
+  // Also track the XKB state of keyboard device_id, in addition to the core keyboard. The keymap of the device
+  // is loaded on the keymap handler if one was set, otherwise it is loaded before returning.
+  // Its state is available through xkb().device(device_id) on the input thread, once loaded.
+  void track_keyboard(uint8_t device_id);
+
+  // Register atoms that should be interned by connect, together with the atoms that Connection needs itself.
+  // This costs no round trip in addition to the one that connect already does. Must be called before connect.
+  void register_atoms(std::span<std::string_view const> names);
+
+  // Connect to the X server; this blocks until all phases below are completed.
   void connect(std::string display_name);
   void close();
 
+  // The phases of connect, in the order in which they must be called. This allows task::XcbConnection
+  // to run the phases that block (on a round trip inside libxcb or xkbcommon-x11) on a thread pool queue,
+  // and to wait for the remaining replies on the socket instead.
+  void open(std::string const& display_name);   // Blocking: connect to the X server and read the setup.
+  void send_atom_requests();                    // Send the InternAtom requests of the atoms that we need.
+  void setup_xkb();                             // Blocking: negotiate the XKB extension.
+  void send_extension_queries();                // Send the version queries of XInput2, Present and MIT-SHM, as far as requested with set_use_*.
+  void create_keymap();                         // Blocking: download the keymap of the core keyboard.
+  void start_input();                           // Start monitoring the socket for readability.
+  // Then either (from a task, see await_reply):
+  void await_extension_replies(AIStatefulTask* task, AIStatefulTask::condition_type condition);  // Wake up task with condition for each reply.
+  void await_atom_replies(AIStatefulTask* task, AIStatefulTask::condition_type condition);       // Idem.
+  bool poll_extension_replies();                // Process the extension replies; returns false if not all replies arrived yet.
+  bool poll_atom_replies();                     // Collect the atom replies; returns false if not all replies arrived yet.
+  // or (blocking, before start_input):
+  void wait_for_extension_replies();            // Blocking: process the extension replies.
+  void wait_for_atom_replies();                 // Blocking: collect the atom replies.
+
   //---------------------------------------------------------------------------
   // After calling `connect` and before calling `close`, you may call:
 
@@ -59,13 +245,172 @@ class Connection : public evio::RawInputDevice
   bool remove(xcb_window_t handle);
 
   // Look up the WindowBase* that was added with `add`.
-  WindowBase* lookup(xcb_window_t handle) const;
+  // Returns nullptr if `destroyed` was called for the handle already.
+  WindowBase* lookup(xcb_window_t handle) const
+  {
+    uintptr_t entry = find(handle);
+    return entry == WindowRegistry::destroyed_window ? nullptr : WindowRegistry::window(entry);
+  }
+
+  // Return true if XInput2 events can be selected.
+  bool has_xinput() const
+  {
+    return m_xinput.opcode() != 0;
+  }
+
+  // Receive the pointer position of window handle with sub-pixel precision (WindowBase::on_precise_mouse_move) and
+  // smooth scrolling (WindowBase::on_scroll). If raw_motion is set, also receive the unaccelerated motion of the pointer
+  // device (WindowBase::on_raw_motion) while the window has the keyboard focus. Does nothing if has_xinput returns false.
+  void select_xinput_events(xcb_window_t handle, bool raw_motion);
+
+  // Return true if Present events can be selected.
+  bool has_present() const
+  {
+    return m_present_opcode.load(std::memory_order_relaxed) != 0;
+  }
+
+  // Receive the CompleteNotify and IdleNotify events of the PresentPixmap and PresentNotifyMSC requests for window handle,
+  // through WindowBase::on_present. Does nothing if has_present returns false.
+  void select_present_events(xcb_window_t handle);
+
+  // Return true if images can be uploaded through shared memory.
+  bool has_shm() const
+  {
+    return m_shm_first_event.load(std::memory_order_relaxed) != 0;
+  }
+
+  // Return true if shared memory segments can be passed as file descriptor (MIT-SHM 1.2).
+  bool shm_fd_passing() const
+  {
+    return m_shm_fd_passing.load(std::memory_order_relaxed);
+  }
+
+  // Called by ShmImage: deliver the ShmCompletion events of segment to buffer (or no longer).
+  void register_shm_buffer(xcb_shm_seg_t segment, ShmBuffer* buffer);
+  void unregister_shm_buffer(xcb_shm_seg_t segment);
+
+  // Turn coalescing of XCB_MOTION_NOTIFY events on or off (default off).
+  // When on, several motion events for the same window and with the same modifier state that
+  // are already queued are collapsed into one: only the newest event is delivered.
+  void set_coalesce_motion(bool coalesce)
+  {
+    m_coalesce_motion.store(coalesce, std::memory_order_relaxed);
+  }
+
+  // Return the number of XCB_MOTION_NOTIFY events that were dropped because of coalescing.
+  uint64_t coalesced_motion_events() const
+  {
+    return m_coalesced_motion_events.load(std::memory_order_relaxed);
+  }
+
+  // Limit the time that a single read_from_fd call keeps the evio thread busy (zero means no limit).
+  // Every event counts, including X errors. When either limit is reached, read_from_fd returns to the event
+  // loop; the events that libxcb already read from the socket are kept in its queue and processed by the next
+  // call, which is triggered locally through the output device (see resume_reading).
+  void set_dispatch_budget(uint32_t max_events, std::chrono::nanoseconds max_time)
+  {
+    m_budget_max_events.store(max_events, std::memory_order_relaxed);
+    m_budget_max_time.store(max_time.count(), std::memory_order_relaxed);
+  }
+
+  // Return the number of times that read_from_fd returned because its budget ran out.
+  uint64_t budget_exhausted_count() const
+  {
+    return m_budget_exhausted_count.load(std::memory_order_relaxed);
+  }
+
+  // Request that the output buffer of libxcb is flushed. The flush happens once, from the event loop,
+  // as soon as the socket is writable; no matter how often mark_dirty is called in the meantime.
+  void mark_dirty()
+  {
+    if (!m_dirty.exchange(true, std::memory_order_relaxed))
+      start_output_device();
+  }
+
+  // Return the number of flushes done on behalf of mark_dirty.
+  uint64_t flushes() const
+  {
+    return m_flushes.load(std::memory_order_relaxed);
+  }
+
+  // Return the number of bytes written by those flushes.
+  uint64_t bytes_written() const
+  {
+    return m_bytes_written.load(std::memory_order_relaxed);
+  }
+
+  // Return the number of those flushes that took longer than slow_flush_threshold (normally because the socket was full).
+  uint64_t slow_flushes() const
+  {
+    return m_slow_flushes.load(std::memory_order_relaxed);
+  }
+
+  // Turn latency instrumentation on or off (default off).
+  // While on, two histograms are recorded per event type (InputEvent::Type): the time from the socket becoming readable
+  // until the return of the WindowBase handler, and the time spent in the handler itself. Calls to WindowBase::on_events
+  // are recorded under type 0 (InputEvent::EndOfPass, which has no handler).
+  void enable_latency_histograms(bool enable);
+
+  // Return the histograms of event type `type`, for use by a monitoring task; or nullptr if the instrumentation was never enabled.
+  // Use LatencyHistogram::snapshot to read (and optionally reset) them.
+  EventLatency* latency_histograms(uint8_t type)
+  {
+    return m_event_latencies ? &(*m_event_latencies)[type & (InputEvent::number_of_types - 1)] : nullptr;
+  }
+
+  // Return the ring buffer that is used for off-thread dispatching, or nullptr if events are dispatched directly.
+  EventRing const* event_ring() const
+  {
+    return m_event_ring.get();
+  }
+
+  // Access to the atom cache; for example to look up the atoms that were registered with register_atoms.
+  AtomCache& atom_cache()
+  {
+    return m_atom_cache;
+  }
+
+  // Wake up `task` with `condition` once the reply (or error) of the request with `sequence` arrived; see AsyncReply.
+  // Many requests can be in flight at the same time this way, without blocking any thread.
+  void await_reply(unsigned int sequence, AsyncReply& reply, AIStatefulTask* task, AIStatefulTask::condition_type condition)
+  {
+    mark_dirty();
+    m_pending_replies.add(m_connection, sequence, reply, task, condition);
+  }
+
+  // Stop waiting for a reply that was passed to await_reply.
+  void cancel_reply(AsyncReply& reply)
+  {
+    m_pending_replies.cancel(m_connection, reply);
+  }
+
+  // Convert a received X11 error to its ProtocolError.
+  errors::org::freedesktop::xcb::ProtocolError protocol_error(xcb_generic_error_t const& error) const
+  {
+    return errors::org::freedesktop::xcb::to_protocol_error(error.error_code, m_xkb.base_error());
+  }
+
+  // Access to the keyboard state; only from the thread that calls read_from_fd.
+  Xkb& xkb()
+  {
+    return m_xkb;
+  }
+
+  // Access to the error router; register the cookie of a request to be notified when that request fails.
+  ErrorRouter& error_router()
+  {
+    return m_error_router;
+  }
 
   // Use the ID returned by generate_id to create a window that is a child window of the root.
   xcb_void_cookie_t create_window(xcb_window_t handle, xcb_window_t parent_handle,
       int16_t x, int16_t y, uint16_t width, uint16_t height,
       std::u8string instance_name, std::u8string const& class_name, std::u8string const& title,
-      uint16_t border_width, uint16_t _class, uint32_t value_mask, std::vector<uint32_t> const& value_list) const;
+      uint16_t border_width, uint16_t _class, uint32_t value_mask, std::vector<uint32_t> const& value_list);
+
+  // Create and map all `windows`, writing the cookies of the requests of each window to `cookies_out` (which must have the same size).
+  // All requests are written back to back and flushed once, from the event loop (see mark_dirty).
+  void create_windows(std::span<WindowDescription const> windows, std::span<WindowCookies> cookies_out);
 
   // Destroy a window using its ID (as returned by generate_id).
   void destroy_window(xcb_window_t handle)
@@ -75,7 +420,7 @@ class Connection : public evio::RawInputDevice
     {
       Dout(dc::notice, "Calling xcb_destroy_window(" << m_connection << ", " << handle << ")");
       xcb_destroy_window(m_connection, handle);
-      xcb_flush(m_connection);
+      mark_dirty();
     }
     destroyed(handle);
   }
@@ -85,6 +430,11 @@ class Connection : public evio::RawInputDevice
     return m_screen->white_pixel;
   }
 
+  uint8_t root_depth() const
+  {
+    return m_screen->root_depth;
+  }
+
   // Raw access.
   operator xcb_connection_t*() const
   {
@@ -99,8 +449,57 @@ class Connection : public evio::RawInputDevice
 
  private:
   void destroyed(xcb_window_t handle);
+  void keymap_changed(uint8_t device_id);
+  void publish_xkb_state(uint8_t device_id, xkb_state* state);
+  void install_pending_xkb_states();
+
+  // Called by task::XkbKeymapLoader.
+  friend class task::XkbKeymapLoader;
+  void load_keymaps();
+  [[noreturn]] static void throw_no_such_window(xcb_window_t handle);
+  void store_atoms();
+  void process_extension_replies();
+  WindowCookies write_create_window_requests(WindowDescription const& window, char8_t* wm_class_buffer) const;
+
+  // Return the registry entry of handle.
+  uintptr_t find(xcb_window_t handle) const
+  {
+    uintptr_t entry = m_window_registry.find(handle);
+    if (AI_UNLIKELY(entry == WindowRegistry::not_found))
+      throw_no_such_window(handle);
+    return entry;
+  }
+
+  // Called by read_from_fd.
+  bool emit(InputEvent const& input_event);
+  void emit_resizes(std::chrono::steady_clock::time_point readiness_time);
+  bool deliver(InputEvent const& input_event);
+  bool push_stalled_events();
+  // Let the event loop call read_from_fd again (through write_to_fd), to continue with the events that libxcb already read from the socket.
+  void resume_reading();
+  void emit_text(InputEvent const& key_press);
+  void emit_expose(xcb_window_t handle, Region&& region);
+  void decode_present_event(xcb_ge_generic_event_t const* event, uint32_t poll_delay_ns, std::chrono::steady_clock::time_point receive_time);
+  void decode_xinput_event(xcb_ge_generic_event_t const* event, uint32_t poll_delay_ns, std::chrono::steady_clock::time_point receive_time);
+
+  // Call the WindowBase callback for input_event. Returns true if this removed the last window.
+  bool dispatch(InputEvent const& input_event);
+  void call_handler(WindowBase* window, InputEvent const& input_event);
+  void call_on_events(WindowBase* window, std::span<InputEvent const> events);
+  // Call WindowBase::on_events for the events that were collected by dispatch.
+  void dispatch_batches();
+  // Call WindowBase::on_text_input for the text that was collected by dispatch.
+  void dispatch_text_inputs();
+  // Call WindowBase::on_expose for the queued regions.
+  void dispatch_exposes();
+  // Call WindowBase::on_present for the queued Present events.
+  void dispatch_present_events();
+
+  friend class task::XcbEventDispatcher;
+  void dispatch_event_ring();
 
   void read_from_fd(int& allow_deletion_count, int fd) override final;
+  void write_to_fd(int& allow_deletion_count, int fd) override final;
   void hup(int& UNUSED_ARG(allow_deletion_count), int UNUSED_ARG(fd)) override final { DoutEntering(dc::notice, "xcb::Connection::hup"); }
   void err(int& UNUSED_ARG(allow_deletion_count), int UNUSED_ARG(fd)) override final { DoutEntering(dc::notice, "xcb::Connection::err"); close(); }
 };
@@ -0,0 +1,90 @@
+#include "sys.h"
+#include "ErrorRouter.h"
+#include <algorithm>
+#include "debug.h"
+
+namespace xcb {
+
+void ErrorRouter::add(xcb_void_cookie_t cookie, handler_type handler)
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  Entry& entry = m_ring[cookie.sequence & ring_mask];
+  if (AI_UNLIKELY(entry.m_handler))
+  {
+    // The previous request in this slot wasn't retired yet; keep it.
+    Dout(dc::notice, "ErrorRouter: moving sequence " << entry.m_sequence << " to the overflow list.");
+    m_overflow.push_back(std::move(entry));
+  }
+  m_outstanding.fetch_add(1, std::memory_order_relaxed);
+  entry.m_sequence = cookie.sequence;
+  entry.m_handler = std::move(handler);
+}
+
+void ErrorRouter::add(xcb_void_cookie_t cookie, AIStatefulTask* task, AIStatefulTask::condition_type condition, xcb_generic_error_t& error_out)
+{
+  add(cookie, [task = boost::intrusive_ptr<AIStatefulTask>(task), condition, &error_out](xcb_void_cookie_t, xcb_generic_error_t const* error){
+    if (error)
+      error_out = *error;
+    else
+      error_out = {};
+    task->signal(condition);
+  });
+}
+
+bool ErrorRouter::route(xcb_generic_error_t const& error)
+{
+  handler_type handler;
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    Entry& entry = m_ring[error.full_sequence & ring_mask];
+    if (entry.m_handler && entry.m_sequence == error.full_sequence)
+    {
+      handler = std::move(entry.m_handler);
+      entry.m_handler = nullptr;
+    }
+    else
+    {
+      auto iter = std::find_if(m_overflow.begin(), m_overflow.end(), [&](Entry const& e){ return e.m_sequence == error.full_sequence; });
+      if (iter == m_overflow.end())
+        return false;
+      handler = std::move(iter->m_handler);
+      m_overflow.erase(iter);
+    }
+    m_outstanding.fetch_sub(1, std::memory_order_relaxed);
+  }
+  // Call the handler without holding the lock, so that it may register new requests.
+  handler({ error.full_sequence }, &error);
+  return true;
+}
+
+void ErrorRouter::do_retire(uint32_t last_sequence)
+{
+  // Call the handlers after releasing the lock, so that they may register new requests.
+  std::vector<Entry> retired;
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    for (Entry& entry : m_ring)
+      if (entry.m_handler && before(entry.m_sequence, last_sequence))
+      {
+        retired.push_back(std::move(entry));
+        entry.m_handler = nullptr;
+      }
+    for (auto iter = m_overflow.begin(); iter != m_overflow.end();)
+    {
+      if (before(iter->m_sequence, last_sequence))
+      {
+        retired.push_back(std::move(*iter));
+        iter = m_overflow.erase(iter);
+      }
+      else
+        ++iter;
+    }
+    m_outstanding.fetch_sub(retired.size(), std::memory_order_relaxed);
+  }
+  // Report success in the order in which the requests were sent.
+  std::sort(retired.begin(), retired.end(), [](Entry const& a, Entry const& b){ return before(a.m_sequence, b.m_sequence); });
+  for (Entry& entry : retired)
+    entry.m_handler({ entry.m_sequence }, nullptr);
+}
+
+} // namespace xcb
@@ -0,0 +1,80 @@
+#pragma once
+
+#include "statefultask/AIStatefulTask.h"
+#include "utils/macros.h"
+#include <xcb/xcb.h>
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+namespace xcb {
+
+// A registry of outstanding checked requests, used to route X errors back to the code that issued the request.
+//
+// Errors of requests without a reply are received by Connection::read_from_fd as an 'event' with response_type 0.
+// Before sending such a request, or right after, the caller may register the returned cookie together with a handler.
+// The handler is called exactly once (from the input thread): with the error if the request failed, or with nullptr
+// once it is known that the request succeeded.
+//
+// Entries are stored in a ring indexed by the low bits of the sequence number; routing an error is a single
+// lookup. Requests that were not registered cost nothing. Entries are retired (calling their handler with nullptr)
+// as soon as read_from_fd receives something with a later sequence number, which means that the request succeeded.
+// Receiving an event with the same sequence number is not enough: the error of a request is sent after the
+// events that were generated while processing it.
+class ErrorRouter
+{
+ public:
+  using handler_type = std::function<void(xcb_void_cookie_t cookie, xcb_generic_error_t const* error)>;
+
+ private:
+  static constexpr int ring_bits = 8;
+  static constexpr uint32_t ring_mask = (1 << ring_bits) - 1;
+
+  struct Entry
+  {
+    uint32_t m_sequence;
+    handler_type m_handler;     // Empty if this entry is not in use.
+  };
+
+  std::mutex m_mutex;                                   // Protects the members below.
+  std::array<Entry, 1 << ring_bits> m_ring;
+  std::vector<Entry> m_overflow;                        // Outstanding entries that were pushed out of their ring slot by a later request.
+  std::atomic<uint32_t> m_outstanding = 0;              // The number of registered entries (in the ring plus the overflow).
+
+  // Return true if sequence `a` was sent before sequence `b` (taking wrap around into account).
+  static bool before(uint32_t a, uint32_t b) { return static_cast<int32_t>(a - b) < 0; }
+
+ public:
+  // Call `handler` when the request of `cookie` completed: with the error if it failed, or with nullptr if it succeeded.
+  void add(xcb_void_cookie_t cookie, handler_type handler);
+
+  // Signal `task` with `condition` when the request of `cookie` completed, after copying the error to `error_out`.
+  // If the request succeeded, error_out is zeroed (X error codes are never zero). The task is kept alive until then.
+  void add(xcb_void_cookie_t cookie, AIStatefulTask* task, AIStatefulTask::condition_type condition, xcb_generic_error_t& error_out);
+
+  // Called by read_from_fd for every error. Returns true if the error was routed to a handler.
+  bool route(xcb_generic_error_t const& error);
+
+  // Called by read_from_fd after receiving anything with sequence number `last_sequence`: all registered
+  // requests before that sequence number succeeded. Their handlers are called with nullptr.
+  void retire(uint32_t last_sequence)
+  {
+    if (AI_LIKELY(m_outstanding.load(std::memory_order_relaxed) == 0))
+      return;
+    do_retire(last_sequence);
+  }
+
+  // Return the number of registered requests that did not complete yet.
+  uint32_t outstanding() const
+  {
+    return m_outstanding.load(std::memory_order_relaxed);
+  }
+
+ private:
+  void do_retire(uint32_t last_sequence);
+};
+
+} // namespace xcb
@@ -0,0 +1,150 @@
+#pragma once
+
+#include "InputEvent.h"
+#include "utils/macros.h"
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <new>
+#include <cstdint>
+
+namespace xcb {
+
+// A bounded single-producer/single-consumer ring buffer of InputEvent records.
+//
+// The producer is the thread that calls Connection::read_from_fd, the consumer is task::XcbEventDispatcher.
+// The head and tail indices are kept on their own cache line to avoid false sharing between the two threads.
+class EventRing
+{
+ public:
+  static constexpr size_t cache_line_size = 64;
+
+  // What to do when an event must be pushed while the ring is full.
+  enum class OverflowPolicy
+  {
+    block,                                      // Stop reading events until the consumer made room.
+    drop_motion                                 // Drop MotionNotify events; stop reading for any other event.
+  };
+
+  // The result of push.
+  enum class PushResult
+  {
+    pushed,
+    wake_consumer,                              // The record was pushed and the depth is at or above the high-water mark.
+    dropped,                                    // The ring is full and the record was a MotionNotify that was dropped (drop_motion).
+    full                                        // The ring is full and the record was not pushed.
+  };
+
+ private:
+  struct AlignedDelete
+  {
+    void operator()(InputEvent* buffer) const { ::operator delete[](buffer, std::align_val_t{cache_line_size}); }
+  };
+
+  std::unique_ptr<InputEvent[], AlignedDelete> m_buffer;
+  uint32_t const m_capacity;                    // A power of two.
+  uint32_t const m_high_water_mark;             // The depth at which the consumer should be woken up without waiting for the end of the read_from_fd pass (at least 1).
+  OverflowPolicy const m_overflow_policy;
+
+  // Consumer cache line.
+  alignas(cache_line_size) std::atomic<uint32_t> m_head = 0;   // Index of the next record to pop.
+  uint32_t m_cached_tail = 0;                   // The last value of m_tail that was read by the consumer.
+
+  // Producer cache line.
+  alignas(cache_line_size) std::atomic<uint32_t> m_tail = 0;   // Index of the next record to push.
+  uint32_t m_cached_head = 0;                   // The last value of m_head that was read by the producer.
+  uint32_t m_woken_at_head = ~uint32_t{0};      // The value of m_head when push last returned PushResult::wake_consumer.
+  std::atomic<uint32_t> m_max_depth = 0;        // The largest depth observed by the producer.
+  std::atomic<uint64_t> m_dropped_motion_events = 0;           // The number of MotionNotify events dropped because the ring was full.
+  std::atomic<uint64_t> m_blocked_pushes = 0;                  // The number of times that push returned PushResult::full.
+  std::atomic<uint64_t> m_high_water_mark_hits = 0;            // The number of times that push returned PushResult::wake_consumer.
+
+  static uint32_t round_up_to_power_of_two(uint32_t depth)
+  {
+    uint32_t capacity = 2;
+    while (capacity < depth)
+      capacity <<= 1;
+    return capacity;
+  }
+
+ public:
+  // Create a ring that can hold at least `depth` records. A high_water_mark of zero is treated as one.
+  EventRing(uint32_t depth, uint32_t high_water_mark, OverflowPolicy overflow_policy) :
+    m_buffer(static_cast<InputEvent*>(::operator new[](round_up_to_power_of_two(depth) * sizeof(InputEvent), std::align_val_t{cache_line_size}))),
+    m_capacity(round_up_to_power_of_two(depth)),
+    m_high_water_mark(std::clamp(high_water_mark, uint32_t{1}, m_capacity)),
+    m_overflow_policy(overflow_policy) { }
+
+  // Called by the producer.
+  //
+  // Returns PushResult::wake_consumer if the depth is at or above the high-water mark and the consumer did not
+  // make progress since the last time that this was returned (if it didn't, it still has a wake-up pending).
+  // Returns PushResult::full if the ring is full and the record must not be dropped: the caller must then keep
+  // the record, wake up the consumer and push the record again once the consumer made room.
+  PushResult push(InputEvent const& input_event)
+  {
+    uint32_t const tail = m_tail.load(std::memory_order_relaxed);
+    if (AI_UNLIKELY(tail - m_cached_head == m_capacity))
+    {
+      m_cached_head = m_head.load(std::memory_order_acquire);
+      if (tail - m_cached_head == m_capacity)
+      {
+        if (m_overflow_policy == OverflowPolicy::drop_motion && input_event.type == InputEvent::MotionNotify)
+        {
+          m_dropped_motion_events.fetch_add(1, std::memory_order_relaxed);
+          return PushResult::dropped;
+        }
+        m_blocked_pushes.fetch_add(1, std::memory_order_relaxed);
+        return PushResult::full;
+      }
+    }
+    m_buffer[tail & (m_capacity - 1)] = input_event;
+    m_tail.store(tail + 1, std::memory_order_release);
+    // Because m_cached_head is only updated when needed, this is an upper bound of the depth.
+    uint32_t depth = tail + 1 - m_cached_head;
+    bool wake_consumer = false;
+    if (AI_UNLIKELY(depth >= m_high_water_mark))
+    {
+      // Get the real depth.
+      m_cached_head = m_head.load(std::memory_order_acquire);
+      depth = tail + 1 - m_cached_head;
+      wake_consumer = depth >= m_high_water_mark && m_cached_head != m_woken_at_head;
+    }
+    if (depth > m_max_depth.load(std::memory_order_relaxed))
+      m_max_depth.store(depth, std::memory_order_relaxed);
+    if (AI_UNLIKELY(wake_consumer))
+    {
+      m_woken_at_head = m_cached_head;
+      m_high_water_mark_hits.fetch_add(1, std::memory_order_relaxed);
+      return PushResult::wake_consumer;
+    }
+    return PushResult::pushed;
+  }
+
+  // Called by the consumer. Returns false if the ring is empty.
+  bool pop(InputEvent& input_event)
+  {
+    uint32_t const head = m_head.load(std::memory_order_relaxed);
+    if (head == m_cached_tail)
+    {
+      m_cached_tail = m_tail.load(std::memory_order_acquire);
+      if (head == m_cached_tail)
+        return false;
+    }
+    input_event = m_buffer[head & (m_capacity - 1)];
+    m_head.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Accessors; these may be called by any thread.
+  uint32_t capacity() const { return m_capacity; }
+  uint32_t high_water_mark() const { return m_high_water_mark; }
+  OverflowPolicy overflow_policy() const { return m_overflow_policy; }
+  uint32_t depth() const { return m_tail.load(std::memory_order_relaxed) - m_head.load(std::memory_order_relaxed); }
+  uint32_t max_depth() const { return m_max_depth.load(std::memory_order_relaxed); }
+  uint64_t dropped_motion_events() const { return m_dropped_motion_events.load(std::memory_order_relaxed); }
+  uint64_t blocked_pushes() const { return m_blocked_pushes.load(std::memory_order_relaxed); }
+  uint64_t high_water_mark_hits() const { return m_high_water_mark_hits.load(std::memory_order_relaxed); }
+};
+
+} // namespace xcb
@@ -0,0 +1,107 @@
+#pragma once
+
+#include <xcb/xcb.h>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+
+namespace xcb {
+
+// The extent of a window.
+struct Extent
+{
+  uint16_t width;
+  uint16_t height;
+
+  bool operator==(Extent const&) const = default;
+};
+
+// The time at which an event happened.
+struct EventTime
+{
+  xcb_timestamp_t server_time;                          // The X server timestamp of the event, in milliseconds; zero for events without one.
+  uint32_t poll_delay_ns;                               // The time between the socket becoming readable and receive_time (saturated).
+  std::chrono::steady_clock::time_point receive_time;   // When xcb_poll_for_event returned the event (this is CLOCK_MONOTONIC).
+
+  // The time at which the start of the read_from_fd pass that received this event was triggered by the socket becoming readable.
+  std::chrono::steady_clock::time_point readiness_time() const { return receive_time - std::chrono::nanoseconds{poll_delay_ns}; }
+};
+
+// A compact record of a decoded X event that must be delivered to a WindowBase.
+struct InputEvent
+{
+  // The number of possible values of Type: all core X event types, plus room for types that are not core events.
+  static constexpr int number_of_types = 64;
+
+  // The values are the X event types that the records are decoded from.
+  enum Type : uint8_t
+  {
+    KeyPress = XCB_KEY_PRESS,
+    KeyRelease = XCB_KEY_RELEASE,
+    ButtonPress = XCB_BUTTON_PRESS,
+    ButtonRelease = XCB_BUTTON_RELEASE,
+    MotionNotify = XCB_MOTION_NOTIFY,
+    EnterNotify = XCB_ENTER_NOTIFY,
+    LeaveNotify = XCB_LEAVE_NOTIFY,
+    FocusIn = XCB_FOCUS_IN,
+    FocusOut = XCB_FOCUS_OUT,
+    DestroyNotify = XCB_DESTROY_NOTIFY,
+    UnmapNotify = XCB_UNMAP_NOTIFY,
+    MapNotify = XCB_MAP_NOTIFY,
+    ConfigureNotify = XCB_CONFIGURE_NOTIFY,
+    DeleteWindow = XCB_CLIENT_MESSAGE,          // A WM_DELETE_WINDOW client message.
+    EndOfPass = 0,                              // Marks the end of a read_from_fd pass in the event ring (0 is the response type of errors).
+    TextInput = 1,                              // Text produced by a KeyPress (1 is not used for events: it is the response type of replies).
+    // XInput2 events (see Connection::select_xinput_events). Their x and y are 16.16 fixed point values, with the fractional parts stored in fraction.
+    PreciseMotion = XCB_GE_GENERIC + 1,         // A XI_Motion event: the pointer position with sub-pixel precision.
+    RawMotion,                                  // A XI_RawMotion event: the unaccelerated motion of the pointer device, in device units.
+    Scroll                                      // The smooth-scroll part of a XI_Motion event: the scroll distance in wheel clicks (x horizontally, y vertically).
+  };
+
+  // The fractional parts of x and y, in units of 1/65536.
+  struct Fraction
+  {
+    uint16_t x;
+    uint16_t y;
+  };
+
+  Type type;
+  union
+  {
+    uint8_t button;                             // ButtonPress/ButtonRelease: the mouse button, starting at 0.
+    bool repeat;                                // KeyPress: set if this is an auto-repeat of a key that is being held down.
+  };
+  uint16_t modifiers;                           // The modifier state, before conversion by WindowBase::convert.
+  xcb_window_t window;                          // The window that the event is for.
+  int16_t x;                                    // The pointer position, relative to window.
+  int16_t y;
+  union
+  {
+    uint32_t keysym;                            // KeyPress/KeyRelease.
+    Extent extent;                              // ConfigureNotify: the new size of the window.
+    char utf8[4];                               // TextInput: up to four bytes of UTF-8 text, padded with zeroes.
+    Fraction fraction;                          // PreciseMotion, RawMotion and Scroll.
+  };
+  EventTime time;                               // The server_time of DeleteWindow is the timestamp of the WM_DELETE_WINDOW message.
+
+  // Set x, y and fraction from the 16.16 fixed point values fixed_x and fixed_y.
+  void set_fixed(int32_t fixed_x, int32_t fixed_y)
+  {
+    x = static_cast<int16_t>(fixed_x >> 16);
+    y = static_cast<int16_t>(fixed_y >> 16);
+    fraction = { static_cast<uint16_t>(fixed_x & 0xffff), static_cast<uint16_t>(fixed_y & 0xffff) };
+  }
+
+  // Convert value to 16.16 fixed point, saturating.
+  static int32_t to_fixed(double value)
+  {
+    return static_cast<int32_t>(std::lround(std::clamp(value, -32768.0, 32767.0) * 65536.0));
+  }
+
+  // The values of x and y of PreciseMotion, RawMotion and Scroll events.
+  double precise_x() const { return x + fraction.x / 65536.0; }
+  double precise_y() const { return y + fraction.y / 65536.0; }
+};
+
+} // namespace xcb
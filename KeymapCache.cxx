@@ -0,0 +1,88 @@
+#include "sys.h"
+#include "KeymapCache.h"
+#include "utils/AIAlert.h"
+#include "utils/macros.h"
+#include <farmhash.h>
+#include <cstdlib>
+#include "debug.h"
+
+namespace xcb {
+
+//static
+KeymapCache& KeymapCache::instance()
+{
+  static KeymapCache s_instance;
+  return s_instance;
+}
+
+KeymapCache::KeymapCache() : m_context(xkb_context_new(XKB_CONTEXT_NO_FLAGS))
+{
+  if (!m_context)
+    THROW_ALERT("Failed to get XKB context");
+}
+
+KeymapCache::~KeymapCache()
+{
+  for (auto& hash_entry : m_keymaps)
+    xkb_keymap_unref(hash_entry.second.m_keymap);
+  xkb_context_unref(m_context);
+}
+
+xkb_keymap* KeymapCache::acquire(xkb_keymap* keymap)
+{
+  // With a single connection there is nothing to share; don't pay for serializing and hashing the keymap.
+  if (m_connections.load(std::memory_order_relaxed) <= 1)
+    return keymap;
+
+  char* serialized_keymap = xkb_keymap_get_as_string(keymap, XKB_KEYMAP_FORMAT_TEXT_V1);
+  if (!serialized_keymap)
+  {
+    xkb_keymap_unref(keymap);
+    THROW_ALERT("Failed to serialize keymap");
+  }
+  std::string serialized(serialized_keymap);
+  free(serialized_keymap);
+  uint64_t hash = util::Hash64(serialized.data(), serialized.size());
+
+  std::lock_guard<std::mutex> lock(m_mutex);
+  auto iter = m_keymaps.find(hash);
+  if (iter == m_keymaps.end())
+  {
+    Dout(dc::notice, "KeymapCache: caching new keymap " << std::hex << hash << std::dec << '.');
+    iter = m_keymaps.emplace(hash, Entry{keymap, 0, std::move(serialized)}).first;
+    m_hashes.emplace(keymap, hash);
+  }
+  else if (AI_UNLIKELY(iter->second.m_serialized != serialized))
+  {
+    Dout(dc::warning, "KeymapCache: hash collision for keymap " << std::hex << hash << std::dec << "; not caching it.");
+    return keymap;
+  }
+  else
+  {
+    Dout(dc::notice, "KeymapCache: reusing keymap " << std::hex << hash << std::dec << '.');
+    xkb_keymap_unref(keymap);
+  }
+  ++iter->second.m_users;
+  return iter->second.m_keymap;
+}
+
+void KeymapCache::release(xkb_keymap* keymap)
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  auto hash_iter = m_hashes.find(keymap);
+  // A keymap that acquire returned without caching it isn't shared.
+  if (hash_iter == m_hashes.end())
+  {
+    xkb_keymap_unref(keymap);
+    return;
+  }
+  auto iter = m_keymaps.find(hash_iter->second);
+  if (--iter->second.m_users == 0)
+  {
+    xkb_keymap_unref(keymap);
+    m_keymaps.erase(iter);
+    m_hashes.erase(hash_iter);
+  }
+}
+
+} // namespace xcb
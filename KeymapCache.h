@@ -0,0 +1,67 @@
+#pragma once
+
+#include <xkbcommon/xkbcommon.h>
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+
+namespace xcb {
+
+// A process-wide xkb_context and a cache of compiled keymaps, shared by all connections.
+//
+// Keymaps are looked up by the 64-bit hash of their serialized (text) form, and compared by that text,
+// so that identical keymaps that were downloaded by different connections are stored once.
+// The X11 download and compile of xkbcommon-x11 can not be skipped, because the serialized form is only
+// known afterwards; a duplicate is released right after compiling it. That download is done with a private
+// context (see Xkb::fetch_state), so that it does not need the lock; only the lookup in the cache does.
+// While there is at most one connection there is nothing to share, and keymaps are not cached at all.
+class KeymapCache
+{
+ private:
+  struct Entry
+  {
+    xkb_keymap* m_keymap;       // The cache owns one reference.
+    int m_users;                // The number of acquire calls that returned this keymap and weren't released yet.
+    std::string m_serialized;   // The text form of m_keymap, to detect hash collisions.
+  };
+
+  std::mutex m_mutex;                                   // Protects the maps below, and the use of m_context.
+  xkb_context* m_context;
+  std::map<uint64_t, Entry> m_keymaps;                  // Hash of the serialized keymap -> Entry.
+  std::map<xkb_keymap*, uint64_t> m_hashes;             // Reverse of m_keymaps.
+  std::atomic<int> m_connections = 0;                   // The number of existing connections (see add_connection).
+
+  KeymapCache();
+  ~KeymapCache();
+
+ public:
+  static KeymapCache& instance();
+
+  // The xkb_context is not thread-safe; keep this lock while using context().
+  std::unique_lock<std::mutex> lock() { return std::unique_lock<std::mutex>(m_mutex); }
+  xkb_context* context() const { return m_context; }
+
+  // Called for every connection that is created and destroyed (by the constructor and destructor of Xkb).
+  void add_connection() { m_connections.fetch_add(1, std::memory_order_relaxed); }
+  void remove_connection() { m_connections.fetch_sub(1, std::memory_order_relaxed); }
+
+  // Take ownership of the (newly compiled) `keymap` and return the cached keymap with the same content.
+  // If there is none yet, `keymap` itself is cached and returned. If there is only one connection, or in the
+  // case of a hash collision, `keymap` is returned without caching it. The returned keymap must be passed to release.
+  // Must be called without holding the lock.
+  xkb_keymap* acquire(xkb_keymap* keymap);
+
+  // Release a keymap that was returned by acquire.
+  void release(xkb_keymap* keymap);
+
+  // The number of different keymaps in the cache.
+  size_t size()
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_keymaps.size();
+  }
+};
+
+} // namespace xcb
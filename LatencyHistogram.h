@@ -0,0 +1,110 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cstdint>
+
+namespace xcb {
+
+// A lock-free histogram of durations with log-linear buckets.
+//
+// Durations are recorded in nanoseconds. Every power of two is divided into 2^sub_bucket_bits linear
+// sub-buckets, so that the relative error of a recorded value is at most 1/2^sub_bucket_bits (12.5%).
+// Durations of 2^max_bits nanoseconds (about 4.3 seconds) or more are counted in the last bucket.
+//
+// record() may be called concurrently by any number of threads; snapshot() can be called by
+// a monitoring thread at any time and does not lose counts when it resets the histogram.
+class LatencyHistogram
+{
+ public:
+  static constexpr int sub_bucket_bits = 3;
+  static constexpr int max_bits = 32;
+  static constexpr uint64_t sub_buckets = uint64_t{1} << sub_bucket_bits;
+  static constexpr int number_of_buckets = (max_bits - sub_bucket_bits + 1) * sub_buckets;
+
+  // Return the index of the bucket that `ns` is counted in.
+  static constexpr int bucket_index(uint64_t ns)
+  {
+    if (ns < sub_buckets)
+      return ns;
+    if (ns >= (uint64_t{1} << max_bits))
+      return number_of_buckets - 1;
+    int const shift = std::bit_width(ns) - 1 - sub_bucket_bits;
+    return (shift + 1) * sub_buckets + ((ns >> shift) & (sub_buckets - 1));
+  }
+
+  // Return the smallest value that is counted in bucket `index`.
+  static constexpr uint64_t bucket_lower_bound(int index)
+  {
+    if (index < static_cast<int>(sub_buckets))
+      return index;
+    int const shift = index / sub_buckets - 1;
+    return (sub_buckets + index % sub_buckets) << shift;
+  }
+
+  struct Snapshot
+  {
+    std::array<uint64_t, number_of_buckets> counts;
+    uint64_t count;                             // The total number of recorded values.
+    uint64_t sum_ns;                            // The sum of all recorded values.
+    uint64_t max_ns;                            // The largest recorded value.
+
+    // Return (the lower bound of the bucket of) the value below which `percentile` percent of the recorded values fall.
+    uint64_t value_at_percentile(double percentile) const
+    {
+      uint64_t const threshold = static_cast<uint64_t>(count * percentile / 100.0);
+      uint64_t seen = 0;
+      for (int index = 0; index < number_of_buckets; ++index)
+      {
+        seen += counts[index];
+        if (seen > threshold)
+          return bucket_lower_bound(index);
+      }
+      return max_ns;
+    }
+
+    uint64_t mean_ns() const { return count == 0 ? 0 : sum_ns / count; }
+  };
+
+ private:
+  std::array<std::atomic<uint64_t>, number_of_buckets> m_counts = {};
+  std::atomic<uint64_t> m_sum_ns = 0;
+  std::atomic<uint64_t> m_max_ns = 0;
+
+ public:
+  void record(std::chrono::nanoseconds duration)
+  {
+    uint64_t const ns = duration.count() < 0 ? 0 : duration.count();
+    m_counts[bucket_index(ns)].fetch_add(1, std::memory_order_relaxed);
+    m_sum_ns.fetch_add(ns, std::memory_order_relaxed);
+    uint64_t max_ns = m_max_ns.load(std::memory_order_relaxed);
+    while (ns > max_ns && !m_max_ns.compare_exchange_weak(max_ns, ns, std::memory_order_relaxed))
+      ;
+  }
+
+  // Return a copy of the current counts. If reset is true then the histogram is reset to empty at the same time.
+  Snapshot snapshot(bool reset = false)
+  {
+    Snapshot result;
+    result.count = 0;
+    for (int index = 0; index < number_of_buckets; ++index)
+    {
+      result.counts[index] = reset ? m_counts[index].exchange(0, std::memory_order_relaxed) : m_counts[index].load(std::memory_order_relaxed);
+      result.count += result.counts[index];
+    }
+    result.sum_ns = reset ? m_sum_ns.exchange(0, std::memory_order_relaxed) : m_sum_ns.load(std::memory_order_relaxed);
+    result.max_ns = reset ? m_max_ns.exchange(0, std::memory_order_relaxed) : m_max_ns.load(std::memory_order_relaxed);
+    return result;
+  }
+};
+
+// The latency histograms of one event type.
+struct EventLatency
+{
+  LatencyHistogram total;                       // From the socket becoming readable till the return of the WindowBase handler.
+  LatencyHistogram handler;                     // The time spent in the WindowBase handler.
+};
+
+} // namespace xcb
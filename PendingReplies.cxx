@@ -0,0 +1,87 @@
+#include "sys.h"
+#include "PendingReplies.h"
+#include <xcb/xcbext.h>
+#include <algorithm>
+#include "debug.h"
+
+namespace xcb {
+
+//static
+bool PendingReplies::poll(xcb_connection_t* connection, AsyncReply* reply, std::vector<Wakeup>& wakeups)
+{
+  if (!xcb_poll_for_reply(connection, reply->m_sequence, &reply->m_reply, &reply->m_error))
+    return false;
+  // Copy the task before setting m_ready: from then on the owner of reply might reuse or destroy it.
+  wakeups.push_back({ reply->m_task, reply->m_condition });
+  reply->m_ready.store(true, std::memory_order_release);
+  return true;
+}
+
+//static
+void PendingReplies::signal(std::vector<Wakeup> const& wakeups)
+{
+  for (Wakeup const& wakeup : wakeups)
+    wakeup.m_task->signal(wakeup.m_condition);
+}
+
+void PendingReplies::add(xcb_connection_t* connection, unsigned int sequence, AsyncReply& reply, AIStatefulTask* task, AIStatefulTask::condition_type condition)
+{
+  reply.reset();
+  reply.m_sequence = sequence;
+  reply.m_task = task;
+  reply.m_condition = condition;
+  std::vector<Wakeup> wakeups;
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    // The reply might already have been read from the socket, in which case read_from_fd won't be called for it.
+    if (!poll(connection, &reply, wakeups))
+    {
+      m_pending.push_back(&reply);
+      m_empty.store(false, std::memory_order_relaxed);
+      return;
+    }
+  }
+  // Signal without holding the lock; the task might call add again.
+  signal(wakeups);
+}
+
+void PendingReplies::cancel(xcb_connection_t* connection, AsyncReply& reply)
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  auto iter = std::find(m_pending.begin(), m_pending.end(), &reply);
+  if (iter == m_pending.end())
+    return;             // Already received.
+  m_pending.erase(iter);
+  m_empty.store(m_pending.empty(), std::memory_order_relaxed);
+  xcb_discard_reply(connection, reply.m_sequence);
+}
+
+void PendingReplies::do_poll_all(xcb_connection_t* connection)
+{
+  std::vector<Wakeup> wakeups;
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    std::erase_if(m_pending, [connection, &wakeups](AsyncReply* reply){ return poll(connection, reply, wakeups); });
+    m_empty.store(m_pending.empty(), std::memory_order_relaxed);
+  }
+  // Signal without holding the lock; the tasks might call add again.
+  signal(wakeups);
+}
+
+void PendingReplies::clear()
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  m_pending.clear();
+  m_empty.store(true, std::memory_order_relaxed);
+}
+
+//static
+void PendingReplies::wait_for(xcb_connection_t* connection, unsigned int sequence, AsyncReply& reply)
+{
+  reply.reset();
+  reply.m_sequence = sequence;
+  reply.m_reply = xcb_wait_for_reply(connection, sequence, &reply.m_error);
+  reply.m_ready.store(true, std::memory_order_release);
+}
+
+} // namespace xcb
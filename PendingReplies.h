@@ -0,0 +1,109 @@
+#pragma once
+
+#include "statefultask/AIStatefulTask.h"
+#include "utils/macros.h"
+#include <boost/intrusive_ptr.hpp>
+#include <xcb/xcb.h>
+#include <atomic>
+#include <cstdlib>
+#include <mutex>
+#include <vector>
+
+namespace xcb {
+
+// The reply (or error) of a request that a task is waiting for, without blocking.
+//
+// Usage, in a task:
+//
+//   case MyTask_send_query:
+//     m_connection->await_reply(xcb_get_geometry(*m_connection, handle).sequence, m_geometry, this, have_reply);
+//     set_state(MyTask_have_geometry);
+//     wait(have_reply);
+//     break;
+//   case MyTask_have_geometry:
+//     if (!m_geometry.ready()) { wait(have_reply); break; }   // Spurious wake up.
+//     if (auto* geometry = m_geometry.get<xcb_get_geometry_reply_t>()) ...
+//
+// The object must stay alive until it is ready, or until it was passed to Connection::cancel_reply.
+class AsyncReply
+{
+ private:
+  friend class PendingReplies;
+  unsigned int m_sequence = 0;
+  void* m_reply = nullptr;
+  xcb_generic_error_t* m_error = nullptr;
+  AIStatefulTask* m_task = nullptr;
+  AIStatefulTask::condition_type m_condition;
+  std::atomic<bool> m_ready = false;
+
+ public:
+  AsyncReply() = default;
+  AsyncReply(AsyncReply const&) = delete;
+  ~AsyncReply() { reset(); }
+
+  // Return true when the reply or error was received.
+  bool ready() const { return m_ready.load(std::memory_order_acquire); }
+
+  // Return the reply, or nullptr if the request failed. Only valid once ready() returns true.
+  template<typename REPLY>
+  REPLY const* get() const { return static_cast<REPLY const*>(m_reply); }
+
+  // Return the error, or nullptr if the request succeeded. Only valid once ready() returns true.
+  xcb_generic_error_t const* error() const { return m_error; }
+
+  // Free the reply and error, so that the object can be reused.
+  void reset()
+  {
+    free(m_reply);
+    free(m_error);
+    m_reply = nullptr;
+    m_error = nullptr;
+    m_ready.store(false, std::memory_order_relaxed);
+  }
+};
+
+// The AsyncReply objects that tasks are waiting for; polled by Connection::read_from_fd.
+class PendingReplies
+{
+ private:
+  std::mutex m_mutex;                                   // Protects m_pending and serializes the calls to xcb_poll_for_reply.
+  std::vector<AsyncReply*> m_pending;
+  std::atomic<bool> m_empty = true;                     // Equal to m_pending.empty().
+
+  // A task that must be signaled after m_mutex was released.
+  struct Wakeup
+  {
+    boost::intrusive_ptr<AIStatefulTask> m_task;
+    AIStatefulTask::condition_type m_condition;
+  };
+
+  // Collect the reply of `reply` if it arrived, adding its task to `wakeups`. Returns true if it did. Must be called with m_mutex locked.
+  static bool poll(xcb_connection_t* connection, AsyncReply* reply, std::vector<Wakeup>& wakeups);
+  static void signal(std::vector<Wakeup> const& wakeups);
+
+ public:
+  // Wake up `task` with `condition` when the reply or error of the request with `sequence` arrived.
+  void add(xcb_connection_t* connection, unsigned int sequence, AsyncReply& reply, AIStatefulTask* task, AIStatefulTask::condition_type condition);
+
+  // Stop waiting for `reply`; the reply is discarded when it arrives.
+  void cancel(xcb_connection_t* connection, AsyncReply& reply);
+
+  // Called by read_from_fd after reading from the socket.
+  void poll_all(xcb_connection_t* connection)
+  {
+    if (AI_LIKELY(m_empty.load(std::memory_order_relaxed)))
+      return;
+    do_poll_all(connection);
+  }
+
+  // Forget all pending replies, without waking up their tasks. Called when the connection is closed.
+  void clear();
+
+  // Blocking: store the reply or error of the request with `sequence` in `reply`. For use before read_from_fd runs.
+  static void wait_for(xcb_connection_t* connection, unsigned int sequence, AsyncReply& reply);
+
+ private:
+  void do_poll_all(xcb_connection_t* connection);
+};
+
+} // namespace xcb
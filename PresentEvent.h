@@ -0,0 +1,33 @@
+#pragma once
+
+#include "InputEvent.h"
+#include <xcb/xcb.h>
+#include <xcb/present.h>
+#include <cstdint>
+
+namespace xcb {
+
+// A decoded event of the Present extension (see Connection::select_present_events).
+//
+// These don't fit in an InputEvent and are only received once per frame; therefore they are
+// queued separately and delivered through WindowBase::on_present after the input events of the same pass.
+struct PresentEvent
+{
+  enum Type : uint8_t
+  {
+    Complete = XCB_PRESENT_COMPLETE_NOTIFY,     // A PresentPixmap or PresentNotifyMSC request completed.
+    Idle = XCB_PRESENT_IDLE_NOTIFY              // The pixmap of a PresentPixmap request may be reused.
+  };
+
+  Type type;
+  uint8_t kind;                                 // Complete: XCB_PRESENT_COMPLETE_KIND_PIXMAP or XCB_PRESENT_COMPLETE_KIND_NOTIFY_MSC.
+  uint8_t mode;                                 // Complete: one of XCB_PRESENT_COMPLETE_MODE_* (copy, flip, skip or suboptimal copy).
+  xcb_window_t window;
+  uint32_t serial;                              // The serial that was passed to the request.
+  xcb_pixmap_t pixmap;                          // Idle: the pixmap that became idle.
+  uint64_t ust;                                 // Complete: the time at which the frame was presented, in microseconds.
+  uint64_t msc;                                 // Complete: the value of the media stamp counter (the vblank count) at that time.
+  EventTime time;
+};
+
+} // namespace xcb
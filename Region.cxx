@@ -0,0 +1,109 @@
+#include "sys.h"
+#include "Region.h"
+#include <algorithm>
+#include <cstdint>
+#include "debug.h"
+
+namespace xcb {
+
+namespace {
+
+int32_t right(xcb_rectangle_t const& rectangle) { return rectangle.x + rectangle.width; }
+int32_t bottom(xcb_rectangle_t const& rectangle) { return rectangle.y + rectangle.height; }
+
+xcb_rectangle_t make_rectangle(int32_t x1, int32_t y1, int32_t x2, int32_t y2)
+{
+  return { static_cast<int16_t>(x1), static_cast<int16_t>(y1), static_cast<uint16_t>(x2 - x1), static_cast<uint16_t>(y2 - y1) };
+}
+
+// Append the parts of a that are not covered by b to out (at most four rectangles).
+void subtract(xcb_rectangle_t const& a, xcb_rectangle_t const& b, std::vector<xcb_rectangle_t>& out)
+{
+  int32_t const top = std::max<int32_t>(a.y, b.y);
+  int32_t const bot = std::min(bottom(a), bottom(b));
+  int32_t const left = std::max<int32_t>(a.x, b.x);
+  int32_t const rig = std::min(right(a), right(b));
+  if (top >= bot || left >= rig)
+  {
+    // No overlap.
+    out.push_back(a);
+    return;
+  }
+  // The full-width bands above and below b.
+  if (a.y < top)
+    out.push_back(make_rectangle(a.x, a.y, right(a), top));
+  if (bot < bottom(a))
+    out.push_back(make_rectangle(a.x, bot, right(a), bottom(a)));
+  // The parts left and right of b, in the band of the overlap.
+  if (a.x < left)
+    out.push_back(make_rectangle(a.x, top, left, bot));
+  if (rig < right(a))
+    out.push_back(make_rectangle(rig, top, right(a), bot));
+}
+
+} // namespace
+
+void Region::add(xcb_rectangle_t rectangle)
+{
+  if (rectangle.width == 0 || rectangle.height == 0)
+    return;
+
+  // Cut the parts that are already covered out of rectangle.
+  m_pieces.assign(1, rectangle);
+  for (xcb_rectangle_t const& covered : m_rectangles)
+  {
+    m_next_pieces.clear();
+    for (xcb_rectangle_t const& piece : m_pieces)
+      subtract(piece, covered, m_next_pieces);
+    m_pieces.swap(m_next_pieces);
+    if (m_pieces.empty())
+      return;
+  }
+
+  for (xcb_rectangle_t const& piece : m_pieces)
+    insert(piece);
+
+  if (m_rectangles.size() > max_rectangles)
+    m_rectangles.assign(1, bounding_box());
+}
+
+void Region::insert(xcb_rectangle_t piece)
+{
+  // Merge with a rectangle of the same width directly above or below, or of the same height directly left or right.
+  for (xcb_rectangle_t& rectangle : m_rectangles)
+  {
+    if (rectangle.x == piece.x && rectangle.width == piece.width && (bottom(rectangle) == piece.y || bottom(piece) == rectangle.y))
+    {
+      rectangle.y = std::min(rectangle.y, piece.y);
+      rectangle.height += piece.height;
+      return;
+    }
+    if (rectangle.y == piece.y && rectangle.height == piece.height && (right(rectangle) == piece.x || right(piece) == rectangle.x))
+    {
+      rectangle.x = std::min(rectangle.x, piece.x);
+      rectangle.width += piece.width;
+      return;
+    }
+  }
+  m_rectangles.push_back(piece);
+}
+
+xcb_rectangle_t Region::bounding_box() const
+{
+  // Must not be called for an empty region.
+  ASSERT(!m_rectangles.empty());
+  int32_t x1 = m_rectangles[0].x;
+  int32_t y1 = m_rectangles[0].y;
+  int32_t x2 = right(m_rectangles[0]);
+  int32_t y2 = bottom(m_rectangles[0]);
+  for (xcb_rectangle_t const& rectangle : m_rectangles)
+  {
+    x1 = std::min<int32_t>(x1, rectangle.x);
+    y1 = std::min<int32_t>(y1, rectangle.y);
+    x2 = std::max(x2, right(rectangle));
+    y2 = std::max(y2, bottom(rectangle));
+  }
+  return make_rectangle(x1, y1, x2, y2);
+}
+
+} // namespace xcb
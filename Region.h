@@ -0,0 +1,44 @@
+#pragma once
+
+#include <xcb/xcb.h>
+#include <cstddef>
+#include <span>
+#include <vector>
+
+namespace xcb {
+
+// A set of non-overlapping rectangles; used to accumulate the exposed areas of a window.
+//
+// Adding a rectangle only adds the parts of it that are not covered yet, and a new part is merged with
+// an existing rectangle when both form a rectangle together. When more than max_rectangles rectangles
+// would be needed, the region is replaced by its bounding box.
+class Region
+{
+ public:
+  static constexpr size_t max_rectangles = 16;
+
+ private:
+  std::vector<xcb_rectangle_t> m_rectangles;
+  std::vector<xcb_rectangle_t> m_pieces;        // Scratch space for add.
+  std::vector<xcb_rectangle_t> m_next_pieces;
+
+ public:
+  // Add rectangle to the region.
+  void add(xcb_rectangle_t rectangle);
+
+  // Make the region empty; this keeps the allocated memory.
+  void clear() { m_rectangles.clear(); }
+
+  bool empty() const { return m_rectangles.empty(); }
+
+  // The rectangles of the region, in no particular order.
+  std::span<xcb_rectangle_t const> rectangles() const { return m_rectangles; }
+
+  // The smallest rectangle that contains the whole region. Only valid if the region is not empty.
+  xcb_rectangle_t bounding_box() const;
+
+ private:
+  void insert(xcb_rectangle_t piece);
+};
+
+} // namespace xcb
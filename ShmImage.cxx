@@ -0,0 +1,228 @@
+#include "sys.h"
+#include "ShmImage.h"
+#include "Connection.h"
+#include <sys/ipc.h>
+#include <sys/mman.h>
+#include <sys/shm.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstdlib>
+#include "debug.h"
+
+namespace xcb {
+
+AIStatefulTask* ShmBuffer::completed(AIStatefulTask::condition_type& condition)
+{
+  m_busy.store(false, std::memory_order_release);
+  return m_owner->take_waiter(condition);
+}
+
+ShmImage::ShmImage(Connection& connection, xcb_window_t window, uint16_t width, uint16_t height, int number_of_buffers) :
+  m_connection(connection), m_window(window), m_gc(connection.generate_id()), m_width(width), m_height(height), m_depth(connection.root_depth())
+{
+  DoutEntering(dc::notice, "xcb::ShmImage::ShmImage(" << window << ", " << width << ", " << height << ", " << number_of_buffers << ")");
+  xcb_connection_t* conn = m_connection;
+
+  // Find the layout of a ZPixmap of our depth.
+  uint32_t bits_per_pixel = 32;
+  uint32_t scanline_pad = 32;
+  for (xcb_format_iterator_t format = xcb_setup_pixmap_formats_iterator(xcb_get_setup(conn)); format.rem; xcb_format_next(&format))
+    if (format.data->depth == m_depth)
+    {
+      bits_per_pixel = format.data->bits_per_pixel;
+      scanline_pad = format.data->scanline_pad;
+      break;
+    }
+  m_stride = (m_width * bits_per_pixel + scanline_pad - 1) / scanline_pad * scanline_pad / 8;
+  // This does a round trip the first time it is called.
+  m_max_request_size = static_cast<size_t>(xcb_get_maximum_request_length(conn)) * 4;
+
+  // Without graphics exposures the server doesn't send a NoExposure event for every put.
+  uint32_t const graphics_exposures = 0;
+  xcb_create_gc(conn, m_gc, window, XCB_GC_GRAPHICS_EXPOSURES, &graphics_exposures);
+
+  size_t const size = static_cast<size_t>(m_stride) * m_height;
+  for (int i = 0; i < number_of_buffers; ++i)
+  {
+    auto& buffer = m_buffers.emplace_back(std::make_unique<ShmBuffer>());
+    buffer->m_owner = this;
+    buffer->m_size = size;
+  }
+
+  m_uses_shm = m_connection.has_shm();
+  if (m_uses_shm)
+  {
+    std::vector<xcb_void_cookie_t> cookies;
+    for (auto& buffer : m_buffers)
+    {
+      xcb_void_cookie_t cookie;
+      if (!allocate_shared(*buffer, cookie))
+      {
+        m_uses_shm = false;
+        break;
+      }
+      cookies.push_back(cookie);
+    }
+    // Wait for the result of all attach requests (this is a single round trip).
+    std::vector<bool> attached(cookies.size());
+    for (size_t i = 0; i < cookies.size(); ++i)
+    {
+      xcb_generic_error_t* error = xcb_request_check(conn, cookies[i]);
+      attached[i] = !error;
+      if (error)
+      {
+        Dout(dc::warning, "Failed to attach shared memory segment: " << m_connection.protocol_error(*error));
+        free(error);
+        m_uses_shm = false;
+      }
+    }
+    if (m_uses_shm)
+    {
+      for (auto& buffer : m_buffers)
+      {
+        // The segment is destroyed as soon as both we and the server detached it.
+        if (buffer->m_shmid != -1)
+          shmctl(buffer->m_shmid, IPC_RMID, nullptr);
+        m_connection.register_shm_buffer(buffer->m_segment, buffer.get());
+      }
+    }
+    else
+    {
+      for (size_t i = 0; i < cookies.size(); ++i)
+        release_shared(*m_buffers[i], attached[i]);
+    }
+  }
+  if (!m_uses_shm)
+  {
+    Dout(dc::notice, "Not using shared memory; images are uploaded with PutImage.");
+    for (auto& buffer : m_buffers)
+      buffer->m_data = new uint8_t[size];
+  }
+  m_connection.mark_dirty();
+}
+
+ShmImage::~ShmImage()
+{
+  for (auto& buffer : m_buffers)
+  {
+    if (m_uses_shm)
+    {
+      m_connection.unregister_shm_buffer(buffer->m_segment);
+      // The server processes the detach after any ShmPutImage of this segment that is still in progress.
+      release_shared(*buffer, true);
+    }
+    else
+      delete [] buffer->m_data;
+  }
+  xcb_free_gc(m_connection, m_gc);
+  m_connection.mark_dirty();
+}
+
+bool ShmImage::allocate_shared(ShmBuffer& buffer, xcb_void_cookie_t& cookie)
+{
+  xcb_connection_t* conn = m_connection;
+  if (m_connection.shm_fd_passing())
+  {
+    int fd = memfd_create("xcb-shm", MFD_CLOEXEC);
+    if (fd == -1)
+      return false;
+    void* data = MAP_FAILED;
+    if (ftruncate(fd, buffer.m_size) == -1 || (data = mmap(nullptr, buffer.m_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED)
+    {
+      ::close(fd);
+      return false;
+    }
+    buffer.m_data = static_cast<uint8_t*>(data);
+    buffer.m_segment = xcb_generate_id(conn);
+    // libxcb closes fd after sending it.
+    cookie = xcb_shm_attach_fd_checked(conn, buffer.m_segment, fd, 0);
+  }
+  else
+  {
+    int shmid = shmget(IPC_PRIVATE, buffer.m_size, IPC_CREAT | 0600);
+    if (shmid == -1)
+      return false;
+    void* data = shmat(shmid, nullptr, 0);
+    if (data == reinterpret_cast<void*>(-1))
+    {
+      shmctl(shmid, IPC_RMID, nullptr);
+      return false;
+    }
+    buffer.m_shmid = shmid;
+    buffer.m_data = static_cast<uint8_t*>(data);
+    buffer.m_segment = xcb_generate_id(conn);
+    cookie = xcb_shm_attach_checked(conn, buffer.m_segment, shmid, 0);
+  }
+  return true;
+}
+
+void ShmImage::release_shared(ShmBuffer& buffer, bool detach)
+{
+  if (detach)
+    xcb_shm_detach(m_connection, buffer.m_segment);
+  if (buffer.m_shmid != -1)
+  {
+    shmctl(buffer.m_shmid, IPC_RMID, nullptr);
+    shmdt(buffer.m_data);
+  }
+  else
+    munmap(buffer.m_data, buffer.m_size);
+  buffer.m_data = nullptr;
+  buffer.m_segment = XCB_NONE;
+  buffer.m_shmid = -1;
+}
+
+ShmBuffer* ShmImage::acquire()
+{
+  for (auto& buffer : m_buffers)
+    if (!buffer->busy())
+      return buffer.get();
+  return nullptr;
+}
+
+void ShmImage::signal_when_available(AIStatefulTask* task, AIStatefulTask::condition_type condition)
+{
+  m_condition = condition;
+  m_waiter.store(task, std::memory_order_release);
+  // A buffer might have completed before the waiter was stored.
+  if (std::any_of(m_buffers.begin(), m_buffers.end(), [](auto const& buffer){ return !buffer->busy(); }))
+    if (AIStatefulTask* waiter = take_waiter(condition))
+      waiter->signal(condition);
+}
+
+AIStatefulTask* ShmImage::take_waiter(AIStatefulTask::condition_type& condition)
+{
+  if (!m_waiter.load(std::memory_order_relaxed))
+    return nullptr;
+  AIStatefulTask* task = m_waiter.exchange(nullptr, std::memory_order_acquire);
+  condition = m_condition;
+  return task;
+}
+
+void ShmImage::put(ShmBuffer* buffer, int16_t dst_x, int16_t dst_y)
+{
+  // Only buffers returned by acquire may be put.
+  ASSERT(!buffer->busy());
+  xcb_connection_t* conn = m_connection;
+  if (m_uses_shm)
+  {
+    buffer->m_busy.store(true, std::memory_order_relaxed);
+    // With send_event set the server sends a ShmCompletion event once it is done reading the buffer.
+    xcb_shm_put_image(conn, m_window, m_gc, m_width, m_height, 0, 0, m_width, m_height, dst_x, dst_y,
+        m_depth, XCB_IMAGE_FORMAT_Z_PIXMAP, 1, buffer->m_segment, 0);
+  }
+  else
+  {
+    // Split the image in bands of rows that each fit in a single request.
+    size_t const rows_per_request = std::max<size_t>(1, (m_max_request_size - sizeof(xcb_put_image_request_t)) / m_stride);
+    for (size_t row = 0; row < m_height; row += rows_per_request)
+    {
+      uint16_t const rows = std::min<size_t>(rows_per_request, m_height - row);
+      xcb_put_image(conn, XCB_IMAGE_FORMAT_Z_PIXMAP, m_window, m_gc, m_width, rows, dst_x, dst_y + row, 0, m_depth,
+          rows * m_stride, buffer->m_data + row * m_stride);
+    }
+  }
+  m_connection.mark_dirty();
+}
+
+} // namespace xcb
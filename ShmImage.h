@@ -0,0 +1,109 @@
+#pragma once
+
+#include "statefultask/AIStatefulTask.h"
+#include <xcb/xcb.h>
+#include <xcb/shm.h>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <vector>
+#include "debug.h"
+
+namespace xcb {
+
+class Connection;
+class ShmImage;
+
+// One image buffer of a ShmImage.
+class ShmBuffer
+{
+ private:
+  friend class ShmImage;
+  ShmImage* m_owner = nullptr;
+  uint8_t* m_data = nullptr;
+  size_t m_size = 0;
+  xcb_shm_seg_t m_segment = XCB_NONE;           // XCB_NONE if the buffer is not in shared memory.
+  int m_shmid = -1;                             // The SysV shared memory ID, or -1 if the buffer is a mapped memfd (or not shared).
+  std::atomic<bool> m_busy = false;             // Set from the ShmPutImage until its ShmCompletion event was received.
+
+ public:
+  // The pixels, in ZPixmap format (see ShmImage::stride).
+  uint8_t* data() const { return m_data; }
+
+  // Return true while the server might still be reading the buffer.
+  bool busy() const { return m_busy.load(std::memory_order_acquire); }
+
+  // Called by Connection::read_from_fd when the ShmCompletion event of this buffer was received.
+  // Returns the task that is waiting for a buffer (see ShmImage::signal_when_available), or nullptr.
+  // The caller must signal it with `condition` after releasing its locks.
+  AIStatefulTask* completed(AIStatefulTask::condition_type& condition);
+};
+
+// A window-sized set of image buffers that are uploaded to a window without copying them through the socket.
+//
+// The buffers are MIT-SHM segments that are allocated and attached once; a memfd passed with ShmAttachFd
+// if the server supports MIT-SHM 1.2, and a SysV segment otherwise. A buffer is busy from `put` until the
+// server sends the ShmCompletion event of its ShmPutImage, after which `acquire` returns it again.
+//
+// If the server does not support MIT-SHM, or runs on a different machine (see Connection::has_shm), the
+// buffers are ordinary memory and `put` uploads them with as many PutImage requests as needed to stay below
+// the maximum request length. Those buffers are never busy.
+//
+// Usage:
+//
+//   xcb::ShmImage image(connection, handle, width, height);
+//   ...
+//   if (xcb::ShmBuffer* buffer = image.acquire())
+//   {
+//     render(buffer->data(), image.stride());
+//     image.put(buffer, 0, 0);
+//   }
+//   else
+//     image.signal_when_available(this, buffer_available);      // Skip this frame, or wait.
+class ShmImage
+{
+ private:
+  Connection& m_connection;
+  xcb_window_t m_window;
+  xcb_gcontext_t m_gc;
+  uint16_t m_width;
+  uint16_t m_height;
+  uint8_t m_depth;
+  uint32_t m_stride;                            // The number of bytes per row.
+  size_t m_max_request_size;                    // The maximum size of a request in bytes.
+  bool m_uses_shm = false;
+  std::vector<std::unique_ptr<ShmBuffer>> m_buffers;
+  std::atomic<AIStatefulTask*> m_waiter = nullptr;      // The task to signal when a busy buffer completes (see signal_when_available).
+  AIStatefulTask::condition_type m_condition;
+
+ public:
+  // Blocking: create number_of_buffers buffers of width x height pixels for window and attach them (one round trip).
+  ShmImage(Connection& connection, xcb_window_t window, uint16_t width, uint16_t height, int number_of_buffers = 2);
+  ~ShmImage();
+
+  ShmImage(ShmImage const&) = delete;
+
+  // Return a buffer that is not busy, or nullptr if all buffers are busy.
+  ShmBuffer* acquire();
+
+  // Signal task with condition as soon as a busy buffer completes. The request is cleared when the signal is sent.
+  void signal_when_available(AIStatefulTask* task, AIStatefulTask::condition_type condition);
+
+  // Upload buffer (which was returned by acquire) to (dst_x, dst_y) of the window.
+  void put(ShmBuffer* buffer, int16_t dst_x, int16_t dst_y);
+
+  uint16_t width() const { return m_width; }
+  uint16_t height() const { return m_height; }
+  uint8_t depth() const { return m_depth; }
+  uint32_t stride() const { return m_stride; }
+  bool uses_shm() const { return m_uses_shm; }
+
+ private:
+  friend class ShmBuffer;
+  // Return the task that was passed to signal_when_available, and its condition, and clear the request.
+  AIStatefulTask* take_waiter(AIStatefulTask::condition_type& condition);
+  bool allocate_shared(ShmBuffer& buffer, xcb_void_cookie_t& cookie);
+  void release_shared(ShmBuffer& buffer, bool detach);
+};
+
+} // namespace xcb
@@ -1,6 +1,12 @@
 #pragma once
 
+#include "InputEvent.h"
+#include "PresentEvent.h"
+#include "Region.h"
+#include <cmath>
 #include <cstdint>
+#include <span>
+#include <string_view>
 #include <string>
 #include <iostream>
 
@@ -46,14 +52,46 @@ class WindowBase
 
   virtual uint16_t convert(uint32_t modifiers) = 0;
 
-  virtual void on_mouse_move (int16_t x, int16_t y, uint16_t converted_modifiers) = 0;
-  virtual void on_key_event  (int16_t x, int16_t y, uint16_t converted_modifiers, bool pressed, uint32_t keysym) = 0;
-  virtual void on_mouse_click(int16_t x, int16_t y, uint16_t converted_modifiers, bool pressed, uint8_t button) = 0;
-  virtual void on_mouse_enter(int16_t x, int16_t y, uint16_t converted_modifiers, bool entered) = 0;
+  virtual void on_mouse_move (int16_t x, int16_t y, uint16_t converted_modifiers, EventTime const& time) = 0;
+  // With detectable auto-repeat (see Xkb::init) a key that is held down generates repeated calls with pressed and repeat set,
+  // followed by a single call with pressed unset when the key is released.
+  virtual void on_key_event  (int16_t x, int16_t y, uint16_t converted_modifiers, bool pressed, bool repeat, uint32_t keysym, EventTime const& time) = 0;
+  virtual void on_mouse_click(int16_t x, int16_t y, uint16_t converted_modifiers, bool pressed, uint8_t button, EventTime const& time) = 0;
+  virtual void on_mouse_enter(int16_t x, int16_t y, uint16_t converted_modifiers, bool entered, EventTime const& time) = 0;
   virtual void on_focus_changed(bool in_focus) = 0;
 
   virtual void On_WM_DELETE_WINDOW(uint32_t timestamp) = 0;
 
+  // XInput2 events; only received for windows passed to Connection::select_xinput_events.
+  // Those windows receive pointer motion through on_precise_mouse_move instead of on_mouse_move.
+  virtual void on_precise_mouse_move(double x, double y, uint16_t converted_modifiers, EventTime const& time)
+  {
+    on_mouse_move(static_cast<int16_t>(std::floor(x)), static_cast<int16_t>(std::floor(y)), converted_modifiers, time);
+  }
+  // The unaccelerated motion of the pointer device (in device units), while this window has the keyboard focus.
+  virtual void on_raw_motion(double /*dx*/, double /*dy*/, EventTime const& /*time*/) { }
+  // Smooth scrolling, in wheel clicks; positive is down or right. The scroll wheel is also still reported as buttons 3 to 6.
+  virtual void on_scroll(double /*dx*/, double /*dy*/, uint16_t /*converted_modifiers*/, EventTime const& /*time*/) { }
+
+  // Called with the merged areas of a series of Expose events, after the last event of the series (the one with count == 0)
+  // was received. Series that complete before the call is made are merged. Only these areas need to be repainted.
+  virtual void on_expose(Region const& /*region*/) { }
+
+  // Called when a frame of this window was presented (PresentEvent::Complete) or when a pixmap may be reused
+  // (PresentEvent::Idle); only for windows passed to Connection::select_present_events.
+  virtual void on_present(PresentEvent const& /*event*/) { }
+
+  // Return true to receive MotionNotify, ButtonPress/Release, KeyPress/Release, EnterNotify/LeaveNotify, FocusIn/FocusOut
+  // and the XInput2 events through on_events instead of through the above callbacks. Called once, by Connection::add.
+  virtual bool batches_input_events() const { return false; }
+
+  // Called with all of the above input events for this window that were received during one read_from_fd pass,
+  // in arrival order. The modifiers of the events are not converted. Only called if batches_input_events returned true.
+  virtual void on_events(std::span<InputEvent const> /*events*/) { }
+
+  // Called with the text (UTF-8, after compose processing) that was typed in this window during one read_from_fd pass.
+  virtual void on_text_input(std::string_view /*text*/) { }
+
   virtual ~WindowBase() = default;
 };
 
@@ -0,0 +1,81 @@
+#include "sys.h"
+#include "WindowRegistry.h"
+#include "utils/AIAlert.h"
+#include <bit>
+#include "debug.h"
+
+namespace xcb {
+
+WindowRegistry::~WindowRegistry()
+{
+  for (auto& segment : m_directory)
+    delete segment.load(std::memory_order_relaxed);
+}
+
+void WindowRegistry::init(uint32_t resource_id_base, uint32_t resource_id_mask)
+{
+  DoutEntering(dc::notice, "xcb::WindowRegistry::init(0x" << std::hex << resource_id_base << ", 0x" << resource_id_mask << std::dec << ")");
+  // Can only be initialized once.
+  ASSERT(m_resource_id_mask == 0);
+  if (resource_id_mask == 0 || (resource_id_base & resource_id_mask) != 0)
+    THROW_ALERT("Invalid resource ID base/mask: 0x[BASE]/0x[MASK]", AIArgs("[BASE]", resource_id_base)("[MASK]", resource_id_mask));
+
+  m_index_shift = std::countr_zero(resource_id_mask);
+  // The number of bits needed to represent the largest index.
+  int index_bits = std::bit_width(resource_id_mask >> m_index_shift);
+  m_segment_bits = std::max(min_segment_bits, index_bits - directory_bits);
+  m_segment_mask = (uint32_t{1} << m_segment_bits) - 1;
+  m_resource_id_base = resource_id_base;
+  m_resource_id_mask = resource_id_mask;
+}
+
+std::atomic<uintptr_t>& WindowRegistry::entry(xcb_window_t handle)
+{
+  // Only called by writers, with m_write_mutex locked.
+  uint32_t const id = handle & m_resource_id_mask;
+  if (AI_UNLIKELY((handle ^ id) != m_resource_id_base))
+    THROW_ALERT("Window handle [HANDLE] was not generated by this connection", AIArgs("[HANDLE]", handle));
+  uint32_t const index = id >> m_index_shift;
+  std::atomic<Segment*>& slot = m_directory[index >> m_segment_bits];
+  Segment* segment = slot.load(std::memory_order_relaxed);
+  if (!segment)
+  {
+    segment = new Segment(size_t{1} << m_segment_bits);
+    slot.store(segment, std::memory_order_release);
+  }
+  return segment->m_entries[index & m_segment_mask];
+}
+
+void WindowRegistry::add(xcb_window_t handle, WindowBase* window, bool batched)
+{
+  // The lower bits of the pointer are used for destroyed_window and batched_input_events.
+  ASSERT(window != nullptr && (reinterpret_cast<uintptr_t>(window) & (destroyed_window | batched_input_events)) == 0);
+  std::lock_guard<std::mutex> lock(m_write_mutex);
+  std::atomic<uintptr_t>& e = entry(handle);
+  // A handle can not be added twice.
+  ASSERT(e.load(std::memory_order_relaxed) == not_found);
+  e.store(reinterpret_cast<uintptr_t>(window) | (batched ? batched_input_events : 0), std::memory_order_release);
+  ++m_number_of_windows;
+}
+
+void WindowRegistry::destroyed(xcb_window_t handle)
+{
+  std::lock_guard<std::mutex> lock(m_write_mutex);
+  std::atomic<uintptr_t>& e = entry(handle);
+  // Can this ever happen?
+  ASSERT(e.load(std::memory_order_relaxed) != not_found);
+  e.store(destroyed_window, std::memory_order_release);
+}
+
+bool WindowRegistry::remove(xcb_window_t handle)
+{
+  std::lock_guard<std::mutex> lock(m_write_mutex);
+  if (find(handle) != not_found)
+  {
+    entry(handle).store(not_found, std::memory_order_release);
+    --m_number_of_windows;
+  }
+  return m_number_of_windows == 0;
+}
+
+} // namespace xcb
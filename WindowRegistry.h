@@ -0,0 +1,97 @@
+#pragma once
+
+#include "WindowBase.h"
+#include "utils/macros.h"
+#include <xcb/xcb.h>
+#include <atomic>
+#include <array>
+#include <memory>
+#include <mutex>
+#include <cstdint>
+
+namespace xcb {
+
+// A map from X window handle to WindowBase*, optimized for lookup.
+//
+// X resource IDs (as returned by xcb_generate_id) are of the form `resource_id_base | (n * inc)`, where inc is
+// the lowest set bit of resource_id_mask and n a small counter that is incremented for every generated ID.
+// Therefore `(handle & resource_id_mask) / inc` is used as direct index into a table of segments. Segments are
+// allocated when first needed and never moved or freed until the registry is destructed, so that `lookup` can
+// read without taking a lock. Only `add`, `destroyed` and `remove` synchronize (with each other).
+//
+// The amount of memory used is bounded by the size of the resource ID space of the connection
+// (typically 2^21 IDs, or at most 16 MB when every possible ID was used for a window).
+class WindowRegistry
+{
+ public:
+  // The result of find() for a handle that was never added, or was removed.
+  static constexpr uintptr_t not_found = 0;
+  // The result of find() for a handle for which destroyed() was called.
+  static constexpr uintptr_t destroyed_window = 1;
+  // Flag bit that is set in the result of find() for windows that receive their input events in batches.
+  static constexpr uintptr_t batched_input_events = 2;
+
+  // Convert the result of find() (for a window that was found and not destroyed) to the WindowBase* that was added.
+  static WindowBase* window(uintptr_t entry)
+  {
+    return reinterpret_cast<WindowBase*>(entry & ~batched_input_events);
+  }
+
+ private:
+  static constexpr int directory_bits = 11;     // The maximum number of segments is 2^directory_bits.
+  static constexpr int min_segment_bits = 8;    // Each segment has at least 256 entries.
+
+  struct Segment
+  {
+    std::unique_ptr<std::atomic<uintptr_t>[]> m_entries;
+
+    Segment(size_t size) : m_entries(new std::atomic<uintptr_t>[size]) { for (size_t i = 0; i < size; ++i) m_entries[i].store(not_found, std::memory_order_relaxed); }
+  };
+
+  uint32_t m_resource_id_base = 0;
+  uint32_t m_resource_id_mask = 0;              // While zero, every lookup fails.
+  int m_index_shift = 0;                        // The number of trailing zeroes of m_resource_id_mask.
+  int m_segment_bits = min_segment_bits;
+  uint32_t m_segment_mask = 0;
+  std::array<std::atomic<Segment*>, 1 << directory_bits> m_directory = {};
+
+  std::mutex m_write_mutex;                     // Protects the members below, and serializes writing to the entries.
+  size_t m_number_of_windows = 0;
+
+ public:
+  WindowRegistry() = default;
+  ~WindowRegistry();
+
+  // Initialize the registry for a connection with the given resource ID base and mask (see xcb_setup_t).
+  // Must be called before any other member function, and may only be called once.
+  void init(uint32_t resource_id_base, uint32_t resource_id_mask);
+
+  // Map handle to window. Set batched if the window receives its input events through WindowBase::on_events.
+  void add(xcb_window_t handle, WindowBase* window, bool batched);
+
+  // Mark handle as destroyed: lookup will return nullptr from now on.
+  void destroyed(xcb_window_t handle);
+
+  // Remove handle from the registry. Return true if this was the last window.
+  bool remove(xcb_window_t handle);
+
+  // Return the WindowBase* that was added for handle (converted to uintptr_t and possibly or-ed with batched_input_events),
+  // or one of not_found or destroyed_window.
+  uintptr_t find(xcb_window_t handle) const
+  {
+    uint32_t const id = handle & m_resource_id_mask;
+    // Windows not created by this connection are never registered.
+    if (AI_UNLIKELY((handle ^ id) != m_resource_id_base))
+      return not_found;
+    uint32_t const index = id >> m_index_shift;
+    Segment const* segment = m_directory[index >> m_segment_bits].load(std::memory_order_acquire);
+    if (AI_UNLIKELY(!segment))
+      return not_found;
+    return segment->m_entries[index & m_segment_mask].load(std::memory_order_acquire);
+  }
+
+ private:
+  std::atomic<uintptr_t>& entry(xcb_window_t handle);
+};
+
+} // namespace xcb
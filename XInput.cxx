@@ -0,0 +1,170 @@
+#include "sys.h"
+#include "XInput.h"
+#include <algorithm>
+#include <bit>
+#include <cstdlib>
+#include "debug.h"
+
+namespace xcb {
+
+//static
+bool XInput::send_queries(xcb_connection_t* conn, unsigned int& version_sequence, unsigned int& devices_sequence)
+{
+  xcb_query_extension_reply_t const* extension = xcb_get_extension_data(conn, &xcb_input_id);
+  if (!extension || !extension->present)
+  {
+    Dout(dc::warning, "The X server does not support the X Input extension.");
+    return false;
+  }
+
+  // Announcing the version that we support is required before the server sends XI2 events to us.
+  // Smooth scrolling needs at least version 2.1.
+  version_sequence = xcb_input_xi_query_version(conn, 2, 2).sequence;
+  // The scroll valuators of all master pointers. The server processes this after XIQueryVersion.
+  devices_sequence = xcb_input_xi_query_device(conn, XCB_INPUT_DEVICE_ALL_MASTER).sequence;
+  return true;
+}
+
+bool XInput::init(xcb_connection_t* conn, xcb_window_t root, xcb_input_xi_query_version_reply_t const* version, xcb_input_xi_query_device_reply_t const* devices)
+{
+  DoutEntering(dc::notice, "xcb::XInput::init()");
+
+  if (!version)
+    return false;
+  bool const supported = version->major_version > 2 || (version->major_version == 2 && version->minor_version >= 1);
+  Dout(dc::notice(!supported), "The X server only supports XInput " << version->major_version << '.' << version->minor_version << '.');
+  if (!supported)
+    return false;
+
+  // Find the scroll valuators of all master pointers.
+  if (devices)
+  {
+    for (xcb_input_xi_device_info_iterator_t info = xcb_input_xi_query_device_infos_iterator(devices); info.rem; xcb_input_xi_device_info_next(&info))
+      add_scroll_valuators(info.data->deviceid, xcb_input_xi_device_info_classes_iterator(info.data));
+  }
+
+  // Keep track of changes of those. An error is reported by read_from_fd.
+  select_events(conn, root, XCB_INPUT_XI_EVENT_MASK_DEVICE_CHANGED);
+
+  // Publish the scroll valuators to read_from_fd, which might already be running.
+  m_opcode.store(xcb_get_extension_data(conn, &xcb_input_id)->major_opcode, std::memory_order_release);
+  return true;
+}
+
+//static
+xcb_void_cookie_t XInput::select_events(xcb_connection_t* conn, xcb_window_t window, uint32_t mask)
+{
+  // The mask follows the xcb_input_event_mask_t header.
+  struct
+  {
+    xcb_input_event_mask_t head;
+    uint32_t mask;
+  } event_mask = { { XCB_INPUT_DEVICE_ALL_MASTER, 1 }, mask };
+  return xcb_input_xi_select_events(conn, window, 1, &event_mask.head);
+}
+
+void XInput::add_scroll_valuators(xcb_input_device_id_t deviceid, xcb_input_device_class_iterator_t classes)
+{
+  std::erase_if(m_scroll_valuators, [deviceid](ScrollValuator const& scroll_valuator){ return scroll_valuator.deviceid == deviceid; });
+
+  // The scroll classes tell which valuators are used for scrolling.
+  for (xcb_input_device_class_iterator_t device_class = classes; device_class.rem; xcb_input_device_class_next(&device_class))
+  {
+    if (device_class.data->type != XCB_INPUT_DEVICE_CLASS_TYPE_SCROLL)
+      continue;
+    xcb_input_scroll_class_t const* scroll_class = reinterpret_cast<xcb_input_scroll_class_t const*>(device_class.data);
+    double const increment = to_double(scroll_class->increment);
+    if (increment == 0.0)
+      continue;
+    Dout(dc::notice, "Device " << deviceid << " scrolls " << (scroll_class->scroll_type == XCB_INPUT_SCROLL_TYPE_HORIZONTAL ? "horizontally" : "vertically") <<
+        " with valuator " << scroll_class->number << " (increment " << increment << ").");
+    m_scroll_valuators.push_back({ deviceid, scroll_class->number, scroll_class->scroll_type == XCB_INPUT_SCROLL_TYPE_HORIZONTAL, false, increment, 0.0 });
+  }
+
+  // The valuator classes contain the current values.
+  for (xcb_input_device_class_iterator_t device_class = classes; device_class.rem; xcb_input_device_class_next(&device_class))
+  {
+    if (device_class.data->type != XCB_INPUT_DEVICE_CLASS_TYPE_VALUATOR)
+      continue;
+    xcb_input_valuator_class_t const* valuator_class = reinterpret_cast<xcb_input_valuator_class_t const*>(device_class.data);
+    for (ScrollValuator& scroll_valuator : m_scroll_valuators)
+      if (scroll_valuator.deviceid == deviceid && scroll_valuator.number == valuator_class->number)
+      {
+        scroll_valuator.value = to_double(valuator_class->value);
+        scroll_valuator.valid = true;
+      }
+  }
+}
+
+void XInput::device_changed(xcb_input_device_changed_event_t const* ev)
+{
+  add_scroll_valuators(ev->deviceid, xcb_input_device_changed_classes_iterator(ev));
+}
+
+void XInput::reset_scroll_valuators()
+{
+  for (ScrollValuator& scroll_valuator : m_scroll_valuators)
+    scroll_valuator.valid = false;
+}
+
+//static
+bool XInput::moved(xcb_input_motion_event_t const* ev)
+{
+  // Valuators 0 and 1 are the x and y coordinates.
+  return xcb_input_button_press_valuator_mask_length(ev) > 0 && (xcb_input_button_press_valuator_mask(ev)[0] & 3);
+}
+
+bool XInput::scroll(xcb_input_motion_event_t const* ev, double& dx, double& dy)
+{
+  dx = dy = 0.0;
+  if (m_scroll_valuators.empty())
+    return false;
+
+  uint32_t const* mask = xcb_input_button_press_valuator_mask(ev);
+  int const mask_length = xcb_input_button_press_valuator_mask_length(ev);
+  xcb_input_fp3232_t const* values = xcb_input_button_press_axisvalues(ev);
+  // There is one value for every bit that is set in the mask, in order.
+  int index = 0;
+  for (int word = 0; word < mask_length; ++word)
+    for (uint32_t bits = mask[word]; bits; bits &= bits - 1)
+    {
+      uint16_t const number = word * 32 + std::countr_zero(bits);
+      double const value = to_double(values[index++]);
+      for (ScrollValuator& scroll_valuator : m_scroll_valuators)
+        if (scroll_valuator.deviceid == ev->deviceid && scroll_valuator.number == number)
+        {
+          // The first value after a reset only serves as reference.
+          if (scroll_valuator.valid)
+            (scroll_valuator.horizontal ? dx : dy) += (value - scroll_valuator.value) / scroll_valuator.increment;
+          scroll_valuator.value = value;
+          scroll_valuator.valid = true;
+        }
+    }
+  return dx != 0.0 || dy != 0.0;
+}
+
+//static
+bool XInput::raw_motion(xcb_input_raw_motion_event_t const* ev, double& dx, double& dy)
+{
+  dx = dy = 0.0;
+  if (xcb_input_raw_button_press_valuator_mask_length(ev) == 0)
+    return false;
+  uint32_t const mask = xcb_input_raw_button_press_valuator_mask(ev)[0];
+  // The unaccelerated values; for a relative device (a mouse) valuators 0 and 1 are the deltas in x and y.
+  xcb_input_fp3232_t const* values = xcb_input_raw_button_press_axisvalues_raw(ev);
+  if ((mask & 1))
+    dx = to_double(*values++);
+  if ((mask & 2))
+    dy = to_double(*values);
+  return (mask & 3);
+}
+
+//static
+uint16_t XInput::modifiers(xcb_input_motion_event_t const* ev)
+{
+  // Bit n of the button mask is set when button n is down; the core state has Button1Mask at bit 8.
+  uint32_t const buttons = xcb_input_button_press_button_mask_length(ev) > 0 ? xcb_input_button_press_button_mask(ev)[0] : 0;
+  return (ev->mods.effective & 0xff) | (((buttons >> 1) & 0x1f) << 8);
+}
+
+} // namespace xcb
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <xcb/xcb.h>
+#include <xcb/xinput.h>
+#include <atomic>
+#include <cstdint>
+#include <vector>
+#include "debug.h"
+
+namespace xcb {
+
+// Support for version 2.2 of the X Input extension (XI2).
+//
+// XI_Motion events carry the pointer position with sub-pixel precision, XI_RawMotion events the unaccelerated
+// deltas of the physical device (without the need to grab the pointer), and since XI 2.1 the scroll wheel (or
+// touchpad) is also reported as a scroll valuator whose value changes by `increment` per wheel click.
+class XInput
+{
+ public:
+  // A scroll valuator of a master pointer.
+  struct ScrollValuator
+  {
+    xcb_input_device_id_t deviceid;     // The master pointer.
+    uint16_t number;                    // The valuator number.
+    bool horizontal;
+    bool valid;                         // Set when value is the last known value of the valuator.
+    double increment;                   // The change of value that corresponds to one wheel click.
+    double value;
+  };
+
+ private:
+  std::atomic<uint8_t> m_opcode = 0;                    // The major opcode of the extension; zero if XI2 is not used.
+  std::vector<ScrollValuator> m_scroll_valuators;       // Only accessed by read_from_fd after init.
+
+ public:
+  // Send XIQueryVersion and XIQueryDevice, without waiting for their replies. The sequence numbers are
+  // returned in version_sequence and devices_sequence. Returns false if the server doesn't have the extension.
+  static bool send_queries(xcb_connection_t* conn, unsigned int& version_sequence, unsigned int& devices_sequence);
+
+  // Negotiate XI 2.2 with the replies of send_queries (nullptr if a request failed), look up the scroll valuators
+  // of all master pointers and select XI_DeviceChanged events on root. Returns false if the server doesn't support it.
+  bool init(xcb_connection_t* conn, xcb_window_t root, xcb_input_xi_query_version_reply_t const* version, xcb_input_xi_query_device_reply_t const* devices);
+
+  // Select the XI2 events in mask (a combination of XCB_INPUT_XI_EVENT_MASK_*) of all master devices on window.
+  // Note that XI_Motion replaces the core MotionNotify event for this client and window.
+  static xcb_void_cookie_t select_events(xcb_connection_t* conn, xcb_window_t window, uint32_t mask);
+
+  // The scroll valuators of the device changed, for example because a different physical mouse is used.
+  void device_changed(xcb_input_device_changed_event_t const* ev);
+
+  // Forget the last values of all scroll valuators. Those change while the pointer is not in one of our windows.
+  void reset_scroll_valuators();
+
+  // Return true if ev changed the pointer position.
+  static bool moved(xcb_input_motion_event_t const* ev);
+
+  // Return true if ev scrolled; the distance, in wheel clicks, is returned in dx and dy.
+  bool scroll(xcb_input_motion_event_t const* ev, double& dx, double& dy);
+
+  // Return true if ev has relative motion; the unaccelerated deltas are returned in dx and dy.
+  static bool raw_motion(xcb_input_raw_motion_event_t const* ev, double& dx, double& dy);
+
+  // Return the modifiers and pressed buttons of ev, encoded like the state of core events.
+  static uint16_t modifiers(xcb_input_motion_event_t const* ev);
+
+  uint8_t opcode() const { return m_opcode.load(std::memory_order_acquire); }
+
+  static double to_double(xcb_input_fp3232_t value) { return value.integral + value.frac / 4294967296.0; }
+
+ private:
+  void add_scroll_valuators(xcb_input_device_id_t deviceid, xcb_input_device_class_iterator_t classes);
+};
+
+} // namespace xcb
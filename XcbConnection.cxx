@@ -32,6 +32,11 @@ char const* XcbConnection::state_str_impl(state_type run_state) const
   switch(run_state)
   {
     AI_CASE_RETURN(XcbConnection_start);
+    AI_CASE_RETURN(XcbConnection_open);
+    AI_CASE_RETURN(XcbConnection_xkb_setup);
+    AI_CASE_RETURN(XcbConnection_keymap);
+    AI_CASE_RETURN(XcbConnection_extensions);
+    AI_CASE_RETURN(XcbConnection_atoms);
     AI_CASE_RETURN(XcbConnection_done);
   }
   AI_NEVER_REACHED;
@@ -53,10 +58,62 @@ void XcbConnection::multiplex_impl(state_type run_state)
   switch (run_state)
   {
     case XcbConnection_start:
-      m_connection->connect(m_display_name);
+      // The blocking phases must not run on the thread that runs this task (see set_blocking_handler).
+      ASSERT(!m_blocking_handler.undefined());
+      m_phase_start = std::chrono::steady_clock::now();
+      // Also load new keymaps there.
+      m_connection->set_keymap_handler(m_blocking_handler);
+      // Continue on the thread pool; xcb_connect and xkbcommon-x11 only provide blocking calls.
+      set_state(XcbConnection_open);
+      yield(m_blocking_handler);
+      break;
+    case XcbConnection_open:
+      m_connection->open(m_display_name);
+      // The atom replies arrive while we are busy with XKB.
+      m_connection->send_atom_requests();
+      end_phase(phase_open);
+      set_state(XcbConnection_xkb_setup);
+      [[fallthrough]];
+    case XcbConnection_xkb_setup:
+      m_connection->setup_xkb();
+      // The version replies of the other extensions arrive while the keymap is downloaded.
+      m_connection->send_extension_queries();
+      end_phase(phase_xkb_setup);
+      set_state(XcbConnection_keymap);
+      [[fallthrough]];
+    case XcbConnection_keymap:
+      m_connection->create_keymap();
+      end_phase(phase_keymap);
+      m_connection->start_input();
+      m_connection->await_extension_replies(this, have_replies);
+      m_connection->await_atom_replies(this, have_replies);
+      set_state(XcbConnection_extensions);
+      [[fallthrough]];
+    case XcbConnection_extensions:
+      // Each reply (of the extensions and of the atoms) signals have_replies once.
+      if (!m_connection->poll_extension_replies())
+      {
+        wait(have_replies);
+        break;
+      }
+      end_phase(phase_extensions);
+      set_state(XcbConnection_atoms);
+      [[fallthrough]];
+    case XcbConnection_atoms:
+      if (!m_connection->poll_atom_replies())
+      {
+        wait(have_replies);
+        break;
+      }
+      end_phase(phase_atoms);
       set_state(XcbConnection_done);
       [[fallthrough]];
     case XcbConnection_done:
+#ifdef CWDEBUG
+      for (int phase = 0; phase < number_of_phases; ++phase)
+        Dout(dc::notice, "Connect phase " << phase << " took " <<
+            std::chrono::duration_cast<std::chrono::microseconds>(m_phase_durations[phase]).count() << " microseconds.");
+#endif
       finish();
       break;
   }
@@ -5,6 +5,8 @@
 #include "utils/AIAlert.h"
 #include "statefultask/AIStatefulTask.h"
 #include "debug.h"
+#include <array>
+#include <chrono>
 #include <string>
 #include <iosfwd>
 
@@ -12,8 +14,24 @@ namespace task {
 
 class XcbConnection : public AIStatefulTask, public xcb::ConnectionData
 {
+ public:
+  // The phases of connecting, for startup profiling (see phase_duration).
+  enum ConnectPhase {
+    phase_open,                 // xcb_connect: opening the socket and the connection setup handshake.
+    phase_xkb_setup,            // Negotiating the XKB extension and selecting XKB events (and XInput2, Present and MIT-SHM, if requested).
+    phase_keymap,               // Downloading and compiling the keymap of the core keyboard.
+    phase_extensions,           // Waiting for the version replies of XInput2, Present and MIT-SHM that were not in yet after the keymap was created.
+    phase_atoms,                // Waiting for the InternAtom replies that were not in yet after the keymap was created.
+    number_of_phases
+  };
+
+  static constexpr condition_type have_replies = 1;
+
  private:
   boost::intrusive_ptr<xcb::Connection> m_connection;           // evio device.
+  AIQueueHandle m_blocking_handler;                             // The thread pool queue to run the blocking phases on.
+  std::chrono::steady_clock::time_point m_phase_start;
+  std::array<std::chrono::steady_clock::duration, number_of_phases> m_phase_durations = {};
 
  protected:
   /// The base class of this task.
@@ -22,6 +40,11 @@ class XcbConnection : public AIStatefulTask, public xcb::ConnectionData
   /// The different states of the stateful task.
   enum XcbConnection_state_type {
     XcbConnection_start = direct_base_type::state_end,
+    XcbConnection_open,
+    XcbConnection_xkb_setup,
+    XcbConnection_keymap,
+    XcbConnection_extensions,
+    XcbConnection_atoms,
     XcbConnection_done,
   };
 
@@ -37,6 +60,21 @@ class XcbConnection : public AIStatefulTask, public xcb::ConnectionData
     return m_connection;
   }
 
+  // The phases that block inside libxcb or xkbcommon-x11 (open, xkb_setup and keymap) are run on `handler`,
+  // so that the thread that runs this task (normally the engine thread) isn't blocked.
+  // The connection also uses `handler` to load new keymaps (see xcb::Connection::set_keymap_handler).
+  // Must be called before running the task.
+  void set_blocking_handler(AIQueueHandle handler)
+  {
+    m_blocking_handler = handler;
+  }
+
+  // The time spent in `phase`; valid after the task finished successfully.
+  std::chrono::steady_clock::duration phase_duration(ConnectPhase phase) const
+  {
+    return m_phase_durations[phase];
+  }
+
   void close();
 
  protected:
@@ -56,6 +94,15 @@ class XcbConnection : public AIStatefulTask, public xcb::ConnectionData
 
   /// Handle mRunState.
   void multiplex_impl(state_type run_state) override;
+
+ private:
+  // Store the time since the previous call (or since the start) as the duration of `phase`.
+  void end_phase(ConnectPhase phase)
+  {
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    m_phase_durations[phase] = now - m_phase_start;
+    m_phase_start = now;
+  }
 };
 
 } // namespace task
@@ -0,0 +1,68 @@
+#include "sys.h"
+#include "XcbEventDispatcher.h"
+#include "Connection.h"
+
+namespace task {
+
+XcbEventDispatcher::XcbEventDispatcher(boost::intrusive_ptr<xcb::Connection> connection COMMA_CWDEBUG_ONLY(bool debug)) :
+  AIStatefulTask(CWDEBUG_ONLY(debug)), m_connection(std::move(connection))
+{
+  DoutEntering(dc::statefultask(mSMDebug), "XcbEventDispatcher() [" << (void*)this << "]");
+}
+
+XcbEventDispatcher::~XcbEventDispatcher()
+{
+  DoutEntering(dc::statefultask(mSMDebug), "~XcbEventDispatcher() [" << (void*)this << "]");
+}
+
+char const* XcbEventDispatcher::state_str_impl(state_type run_state) const
+{
+  switch(run_state)
+  {
+    AI_CASE_RETURN(XcbEventDispatcher_start);
+    AI_CASE_RETURN(XcbEventDispatcher_dispatch);
+    AI_CASE_RETURN(XcbEventDispatcher_done);
+  }
+  AI_NEVER_REACHED;
+}
+
+char const* XcbEventDispatcher::task_name_impl() const
+{
+  return "XcbEventDispatcher";
+}
+
+void XcbEventDispatcher::initialize_impl()
+{
+  DoutEntering(dc::statefultask(mSMDebug), "XcbEventDispatcher::initialize_impl() [" << (void*)this << "]");
+  set_state(XcbEventDispatcher_start);
+}
+
+void XcbEventDispatcher::multiplex_impl(state_type run_state)
+{
+  switch (run_state)
+  {
+    case XcbEventDispatcher_start:
+      set_state(XcbEventDispatcher_dispatch);
+      wait(have_events);
+      break;
+    case XcbEventDispatcher_dispatch:
+      if (m_stop.load(std::memory_order_relaxed))
+      {
+        set_state(XcbEventDispatcher_done);
+        break;
+      }
+      m_connection->dispatch_event_ring();
+      wait(have_events);
+      break;
+    case XcbEventDispatcher_done:
+      finish();
+      break;
+  }
+}
+
+void XcbEventDispatcher::finish_impl()
+{
+  m_connection.reset();
+}
+
+} // namespace task
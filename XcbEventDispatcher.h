@@ -0,0 +1,74 @@
+#pragma once
+
+#include "statefultask/AIStatefulTask.h"
+#include "debug.h"
+#include <atomic>
+
+namespace xcb {
+class Connection;
+} // namespace xcb
+
+namespace task {
+
+// A task that delivers the events that xcb::Connection::read_from_fd decoded into its EventRing to the WindowBase callbacks.
+//
+// Run this task with the handler (AIQueueHandle) of the thread pool queue that the callbacks should be called from.
+class XcbEventDispatcher : public AIStatefulTask
+{
+ private:
+  boost::intrusive_ptr<xcb::Connection> m_connection;   // Released when the task finishes.
+  std::atomic<bool> m_stop = false;
+
+ public:
+  static constexpr condition_type have_events = 1;
+
+ protected:
+  /// The base class of this task.
+  using direct_base_type = AIStatefulTask;
+
+  /// The different states of the stateful task.
+  enum XcbEventDispatcher_state_type {
+    XcbEventDispatcher_start = direct_base_type::state_end,
+    XcbEventDispatcher_dispatch,
+    XcbEventDispatcher_done,
+  };
+
+ public:
+  /// One beyond the largest state of this task.
+  static constexpr state_type state_end = XcbEventDispatcher_done + 1;
+
+  /// Construct a XcbEventDispatcher object.
+  XcbEventDispatcher(boost::intrusive_ptr<xcb::Connection> connection COMMA_CWDEBUG_ONLY(bool debug));
+
+  // Called by Connection::read_from_fd after pushing events into the ring.
+  void events_available()
+  {
+    signal(have_events);
+  }
+
+  // Called by Connection::close; causes the task to finish.
+  void stop()
+  {
+    m_stop.store(true, std::memory_order_relaxed);
+    signal(have_events);
+  }
+
+ protected:
+  /// Call finish() (or abort()), not delete.
+  ~XcbEventDispatcher() override;
+
+  /// Implementation of state_str for run states.
+  char const* state_str_impl(state_type run_state) const override;
+  char const* task_name_impl() const override;
+
+  /// Run bs_initialize.
+  void initialize_impl() override;
+
+  /// Handle mRunState.
+  void multiplex_impl(state_type run_state) override;
+
+  /// Release the connection.
+  void finish_impl() override;
+};
+
+} // namespace task
@@ -1,10 +1,17 @@
 #pragma once
 
+#include "KeymapCache.h"
 #include "utils/AIAlert.h"
+#include "utils/macros.h"
 #include <xkbcommon/xkbcommon.h>
 #include <xkbcommon/xkbcommon-x11.h>
+#include <xkbcommon/xkbcommon-compose.h>
 #include "debug.h"
+#include <array>
+#include <cstdlib>
 #include <iomanip>
+#include <memory>
+#include <span>
 // Really?
 #define explicit _explicit
 #include <xcb/xkb.h>
@@ -14,13 +21,129 @@ namespace xcb {
 
 class Xkb
 {
+ public:
+  // The translation of a keycode under the current state.
+  struct Key
+  {
+    xkb_keysym_t keysym;
+    xkb_mod_mask_t consumed_mods;
+    uint32_t generation;        // Equal to m_generation when this entry is up to date.
+  };
+
+  // The keymap and state of one keyboard device.
+  class Device
+  {
+   private:
+    struct xkb_keymap* m_keymap = {};                   // Shared through the KeymapCache.
+    struct xkb_state* m_state = {};
+
+    // A cache of the translation of each keycode, filled on demand. Incrementing m_generation invalidates all entries;
+    // that happens when the keymap, or the effective modifiers or group change.
+    std::array<Key, 256> m_keys = {};
+    uint32_t m_generation = 1;
+    xkb_mod_mask_t m_active_mods = 0;
+
+    // The last StateNotify that was received for this device; re-applied by install_state.
+    xcb_xkb_state_notify_event_t m_last_state_notify;
+    bool m_have_state_notify = false;
+
+    xkb_state_component apply_state_notify()
+    {
+      xcb_xkb_state_notify_event_t const& ev = m_last_state_notify;
+      return xkb_state_update_mask(m_state, ev.baseMods, ev.latchedMods, ev.lockedMods, ev.baseGroup, ev.latchedGroup, ev.lockedGroup);
+    }
+
+    void invalidate_keys()
+    {
+      ++m_generation;
+      m_active_mods = xkb_state_serialize_mods(m_state, XKB_STATE_MODS_EFFECTIVE);
+    }
+
+    [[gnu::noinline]] Key const& fill_key(xcb_keycode_t code)
+    {
+      Key& key = m_keys[code];
+      key.keysym = xkb_state_key_get_one_sym(m_state, code);
+      key.consumed_mods = xkb_state_key_get_consumed_mods2(m_state, code, XKB_CONSUMED_MODE_XKB);
+#if 0
+      // Just left here to show how to print the names of the modifiers.
+      ASSERT(m_keymap == xkb_state_get_keymap(m_state));
+      xkb_layout_index_t layout = xkb_state_key_get_layout(m_state, code);
+      Dout(dc::notice, "layout [ " << xkb_keymap_layout_get_name(m_keymap, layout) << " (" << layout << ") ]");
+      Dout(dc::notice, "level [ " << xkb_state_key_get_level(m_state, code, layout) << " ]");
+      auto number_of_mods = xkb_keymap_num_mods(m_keymap);
+      Dout(dc::notice|continued_cf, "mods [ ");
+      for (xkb_mod_index_t mod = 0; mod < number_of_mods; ++mod)
+      {
+        if (xkb_state_mod_index_is_active(m_state, mod, XKB_STATE_MODS_EFFECTIVE) <= 0)
+          continue;
+        if (xkb_state_mod_index_is_consumed(m_state, code, mod))
+          Dout(dc::continued, '-' << xkb_keymap_mod_get_name(m_keymap, mod) << ' ');
+        else
+          Dout(dc::continued, xkb_keymap_mod_get_name(m_keymap, mod) << ' ');
+      }
+      Dout(dc::finish, "]");
+#endif
+      key.generation = m_generation;
+      return key;
+    }
+
+   public:
+    // Replace the current keymap and state with `state` (as returned by fetch_state), releasing the old ones.
+    //
+    // The state might have been fetched on another thread while StateNotify events were applied to the old state.
+    // Those changes would be lost, so the last StateNotify is applied again. This is correct even when that event
+    // is older than the fetched state: the events that describe the newer state are then still to be received.
+    void install_state(xkb_state* state)
+    {
+      if (m_state)
+        discard_state(m_state);
+      m_state = state;
+      m_keymap = xkb_state_get_keymap(state);
+      if (m_have_state_notify)
+        apply_state_notify();
+      invalidate_keys();
+    }
+
+    void update_state(xcb_xkb_state_notify_event_t const* ev)
+    {
+      m_last_state_notify = *ev;
+      m_have_state_notify = true;
+      xkb_state_component changed = apply_state_notify();
+      // Only the effective modifiers and group influence the translation of keycodes.
+      if ((changed & (XKB_STATE_MODS_EFFECTIVE | XKB_STATE_LAYOUT_EFFECTIVE)))
+        invalidate_keys();
+    }
+
+    // Return the keysym and consumed modifiers of `code` under the current state.
+    Key const& key(xcb_keycode_t code)
+    {
+      Key const& key = m_keys[code];
+      if (AI_LIKELY(key.generation == m_generation))
+        return key;
+      return fill_key(code);
+    }
+
+    // Return the effective modifiers of the current state.
+    xkb_mod_mask_t active_mods() const
+    {
+      return m_active_mods;
+    }
+
+    ~Device()
+    {
+      if (m_state)
+        discard_state(m_state);
+    }
+  };
+
  private:
-  struct xkb_context* m_ctx = {};
-  struct xkb_keymap* m_keymap = {};
-  struct xkb_state* m_state = {};
-  uint8_t m_device_id;
+  // The keyboards that we track, indexed by device ID (which is sent with the XKB protocol as a single byte).
+  std::array<std::unique_ptr<Device>, 256> m_devices;
+  xkb_compose_state* m_compose_state = nullptr;         // Null if there is no compose table for the current locale.
+  uint8_t m_device_id;                                  // The ID of the core keyboard.
   uint8_t m_xkb_opcode;
   uint8_t m_xkb_base_error;
+  bool m_detectable_auto_repeat = false;                // Set if the server agreed to not send a KeyRelease for auto-repeated keys.
 
  public:
   void init(xcb_connection_t* conn)
@@ -30,12 +153,7 @@ class Xkb
     if (!reply)
       THROW_ALERT("Failed in querying XKB extension which is required");
 
-    // Create a XKB context.
-    {
-      m_ctx = xkb_context_new(XKB_CONTEXT_NO_FLAGS);
-      if (!m_ctx)
-        THROW_ALERT("Failed to get XKB context");
-    }
+    // The XKB context is shared by all connections (see KeymapCache).
 
     // Negotiate the XKB extension with the X server.
     {
@@ -67,16 +185,66 @@ class Xkb
       m_device_id = static_cast<uint8_t>(device_id);    // Device ID's are sent with the XKB protocol as a single byte.
     }
 
-    // Create initial xkb_keymap and xkb_state for the core device.
-    create_keymap_and_state(conn);
+    // Load the compose table of the current locale. Not having one is not an error; text input then works without compose sequences.
+    {
+      char const* locale = std::getenv("LC_ALL");
+      if (!locale || !*locale)
+        locale = std::getenv("LC_CTYPE");
+      if (!locale || !*locale)
+        locale = std::getenv("LANG");
+      if (!locale || !*locale)
+        locale = "C";
+      KeymapCache& cache = KeymapCache::instance();
+      xkb_compose_table* compose_table;
+      {
+        auto lock = cache.lock();
+        compose_table = xkb_compose_table_new_from_locale(cache.context(), locale, XKB_COMPOSE_COMPILE_NO_FLAGS);
+      }
+      if (compose_table)
+      {
+        m_compose_state = xkb_compose_state_new(compose_table, XKB_COMPOSE_STATE_NO_FLAGS);
+        xkb_compose_table_unref(compose_table);         // The state keeps its own reference.
+      }
+      else
+        Dout(dc::warning, "No compose table for locale \"" << locale << "\".");
+    }
 
+    // Select the XKB events of the core keyboard.
+    xcb_generic_error_t* error = xcb_request_check(conn, select_events(conn, m_device_id));
+    if (error)
+    {
+      free(error);
+      THROW_ALERT("Failed to request XKB events");
+    }
+
+    // Ask for detectable auto-repeat: while a key is held down the server then only repeats the KeyPress,
+    // instead of sending a synthetic KeyRelease/KeyPress pair for every repeat. This is a per-client setting.
+    {
+      static constexpr uint32_t flags = XCB_XKB_PER_CLIENT_FLAG_DETECTABLE_AUTO_REPEAT;
+      xcb_xkb_per_client_flags_reply_t* reply =
+        xcb_xkb_per_client_flags_reply(conn, xcb_xkb_per_client_flags(conn, XCB_XKB_ID_USE_CORE_KBD, flags, flags, 0, 0, 0), nullptr);
+      if (reply)
+      {
+        m_detectable_auto_repeat = (reply->supported & reply->value & flags);
+        free(reply);
+      }
+      if (!m_detectable_auto_repeat)
+        Dout(dc::warning, "The X server does not support detectable auto-repeat.");
+    }
+
+    // The initial xkb_keymap and xkb_state for the core device are created by a separate call to create_keymap_and_state.
+  }
+
+  // Select the XKB events that we need for device_id.
+  static xcb_void_cookie_t select_events(xcb_connection_t* conn, uint8_t device_id)
+  {
     // According to https://xkbcommon.org/doc/current/group__x11.html you have to listen to NewKeyboardNotify and MapNotify
-    // events and recreate m_keymap and m_state when received.
+    // events and recreate the keymap and state when received.
     //
-    // I am not going to support NewKeyboardNotify at the moment, and MapNotify doesn't seem to contain any useful information
-    // in itself. XCB already generates the XCB_MAPPING_NOTIFY event, so might as well use that instead of MapNotify.
+    // XCB already generates the XCB_MAPPING_NOTIFY event, so might as well use that instead of MapNotify.
     // However, With XKB enabled, X won't send XCB_MAPPING_NOTIFY anymore! So we have to listen to XCB_XKB_EVENT_TYPE_MAP_NOTIFY
-    // anyway.
+    // anyway. A NewKeyboardNotify is sent for a device when it starts to use a different keyboard (for the core keyboard:
+    // when a different physical keyboard is used); only the keymap of that device is reloaded.
 
     static constexpr uint16_t required_map_parts =
 //        XCB_XKB_MAP_PART_KEY_TYPES |
@@ -88,81 +256,176 @@ class Xkb
 //        XCB_XKB_MAP_PART_VIRTUAL_MOD_MAP;
 
     static constexpr uint16_t required_events =
-/*        XCB_XKB_EVENT_TYPE_NEW_KEYBOARD_NOTIFY | */
+        XCB_XKB_EVENT_TYPE_NEW_KEYBOARD_NOTIFY |
         XCB_XKB_EVENT_TYPE_MAP_NOTIFY |
         XCB_XKB_EVENT_TYPE_STATE_NOTIFY;
 
-    xcb_void_cookie_t cookie = xcb_xkb_select_events(conn, m_device_id, required_events, 0, required_events, required_map_parts, required_map_parts, nullptr);
+    // Only a change of keycodes requires a new keymap.
+    static constexpr uint16_t required_nkn_details = XCB_XKB_NKN_DETAIL_KEYCODES;
 
-    xcb_generic_error_t* error = xcb_request_check(conn, cookie);
-    if (error)
-      THROW_ALERT("Failed to request XKB events");
+    // The state components that are passed to xkb_state_update_mask (see Device::update_state).
+    // Everything else (in particular the pointer button state, compat and grab state) is not selected,
+    // so that clicking the mouse or grabs of other clients don't cause a StateNotify.
+    static constexpr uint16_t required_state_details =
+        XCB_XKB_STATE_PART_MODIFIER_BASE |
+        XCB_XKB_STATE_PART_MODIFIER_LATCH |
+        XCB_XKB_STATE_PART_MODIFIER_LOCK |
+        XCB_XKB_STATE_PART_GROUP_BASE |
+        XCB_XKB_STATE_PART_GROUP_LATCH |
+        XCB_XKB_STATE_PART_GROUP_LOCK;
+
+    xcb_xkb_select_events_details_t details = {};
+    details.affectNewKeyboard = required_nkn_details;
+    details.newKeyboardDetails = required_nkn_details;
+    details.affectState = required_state_details;
+    details.stateDetails = required_state_details;
+
+    // Pass selectAll = 0: the details of NewKeyboardNotify and StateNotify are selected through `details`.
+    return xcb_xkb_select_events_aux(conn, device_id, required_events, 0, 0, required_map_parts, required_map_parts, &details);
   }
 
-  void create_keymap_and_state(xcb_connection_t* conn)
+  // Download and compile the keymap of keyboard device_id, and create a state for it. Returns the new state;
+  // its keymap is shared with other connections through the KeymapCache. This does round trips to the server
+  // (blocking) and may be called from any thread.
+  static xkb_state* fetch_state(xcb_connection_t* conn, uint8_t device_id)
   {
-    DoutEntering(dc::notice, "xcb::Xkb::create_keymap_and_state()");
+    DoutEntering(dc::notice, "xcb::Xkb::fetch_state(" << (int)device_id << ")");
 
-    m_keymap = xkb_x11_keymap_new_from_device(m_ctx, conn, m_device_id, XKB_KEYMAP_COMPILE_NO_FLAGS);
-    if (!m_keymap)
+    // Downloading the keymap blocks on round trips to the server. Don't hold the lock of the shared context
+    // during that, but use a context of our own; it is kept alive by the keymap (if that ends up in the cache).
+    xkb_context* context = xkb_context_new(static_cast<xkb_context_flags>(XKB_CONTEXT_NO_DEFAULT_INCLUDES | XKB_CONTEXT_NO_ENVIRONMENT_NAMES));
+    if (!context)
+      THROW_ALERT("Failed to get XKB context");
+    xkb_keymap* compiled_keymap = xkb_x11_keymap_new_from_device(context, conn, device_id, XKB_KEYMAP_COMPILE_NO_FLAGS);
+    xkb_context_unref(context);
+    if (!compiled_keymap)
       THROW_ALERT("Failed to get keymap from X11 server");
+    KeymapCache& cache = KeymapCache::instance();
+    xkb_keymap* keymap = cache.acquire(compiled_keymap);
 
-    m_state = xkb_x11_state_new_from_device(m_keymap, conn, m_device_id);
-    if (!m_state)
+    xkb_state* state = xkb_x11_state_new_from_device(keymap, conn, device_id);
+    if (!state)
+    {
+      cache.release(keymap);
       THROW_ALERT("Failed to create a keyboard state object");
+    }
+
+    return state;
   }
 
-  void update_state(xcb_xkb_state_notify_event_t const* ev)
+  // Release a state that was returned by fetch_state but will not be installed.
+  static void discard_state(xkb_state* state)
   {
-    xkb_state_update_mask(m_state, ev->baseMods, ev->latchedMods, ev->lockedMods, ev->baseGroup, ev->latchedGroup, ev->lockedGroup);
+    xkb_keymap* keymap = xkb_state_get_keymap(state);
+    xkb_state_unref(state);
+    KeymapCache::instance().release(keymap);
   }
 
-  xkb_keysym_t get_one_sym(xcb_keycode_t code)
+  // Replace the keymap and state of keyboard device_id with `state` (as returned by fetch_state), releasing the old ones.
+  // Starts tracking the device if it wasn't tracked yet. Must be called by the thread that translates key events.
+  void install_state(uint8_t device_id, xkb_state* state)
   {
-    return xkb_state_key_get_one_sym(m_state, code);
+    if (!m_devices[device_id])
+      m_devices[device_id] = std::make_unique<Device>();
+    m_devices[device_id]->install_state(state);
   }
 
-  xkb_mod_mask_t get_active_mods()
+  void create_keymap_and_state(xcb_connection_t* conn)
   {
-    return xkb_state_serialize_mods(m_state, XKB_STATE_MODS_EFFECTIVE);
+    install_state(m_device_id, fetch_state(conn, m_device_id));
   }
 
-  xkb_mod_mask_t get_consumed_mods(xcb_keycode_t code)
+  // Return the keyboard with device_id, or nullptr if we don't track it.
+  Device* device(uint8_t device_id) const
   {
-#if 0
-    // Just left here to show how to print the names of the modifiers.
-    ASSERT(m_keymap == xkb_state_get_keymap(m_state));
-    xkb_layout_index_t layout = xkb_state_key_get_layout(m_state, code);
-    Dout(dc::notice, "layout [ " << xkb_keymap_layout_get_name(m_keymap, layout) << " (" << layout << ") ]");
-    Dout(dc::notice, "level [ " << xkb_state_key_get_level(m_state, code, layout) << " ]");
-    auto number_of_mods = xkb_keymap_num_mods(m_keymap);
-    Dout(dc::notice|continued_cf, "mods [ ");
-    for (xkb_mod_index_t mod = 0; mod < number_of_mods; ++mod)
+    return m_devices[device_id].get();
+  }
+
+  // The core keyboard, whose state is used to translate core key events.
+  Device& core() const
+  {
+    return *m_devices[m_device_id];
+  }
+
+  // Return the keysym and consumed modifiers of `code` under the current state of the core keyboard.
+  Key const& key(xcb_keycode_t code)
+  {
+    return core().key(code);
+  }
+
+  // Return the effective modifiers of the current state of the core keyboard.
+  xkb_mod_mask_t active_mods() const
+  {
+    return core().active_mods();
+  }
+
+  // Feed the keysym of a key press to the compose state machine and write the text that it produces, if any, as UTF-8 to `buffer`.
+  // Returns the length of the text; zero if the key doesn't produce text or is part of an unfinished compose sequence.
+  size_t text(xkb_keysym_t keysym, std::span<char> buffer)
+  {
+    if (m_compose_state && xkb_compose_state_feed(m_compose_state, keysym) == XKB_COMPOSE_FEED_ACCEPTED)
     {
-      if (xkb_state_mod_index_is_active(m_state, mod, XKB_STATE_MODS_EFFECTIVE) <= 0)
-        continue;
-      if (xkb_state_mod_index_is_consumed(m_state, code, mod))
-        Dout(dc::continued, '-' << xkb_keymap_mod_get_name(m_keymap, mod) << ' ');
-      else
-        Dout(dc::continued, xkb_keymap_mod_get_name(m_keymap, mod) << ' ');
+      switch (xkb_compose_state_get_status(m_compose_state))
+      {
+        case XKB_COMPOSE_COMPOSING:
+          return 0;
+        case XKB_COMPOSE_COMPOSED:
+        {
+          int length = xkb_compose_state_get_utf8(m_compose_state, buffer.data(), buffer.size());
+          // A compose sequence might only define a keysym; then use the text of that keysym.
+          if (length <= 0)
+            length = xkb_keysym_to_utf8(xkb_compose_state_get_one_sym(m_compose_state), buffer.data(), buffer.size()) - 1;
+          xkb_compose_state_reset(m_compose_state);
+          if (length <= 0)
+            return 0;
+          size_t size = static_cast<size_t>(length);
+          if (size >= buffer.size())
+          {
+            // Truncated (excluding the terminating zero). Drop the last character if it was cut in half.
+            size = buffer.size() - 1;
+            size_t start = size - 1;
+            while (start > 0 && (buffer[start] & 0xc0) == 0x80)
+              --start;
+            unsigned char lead = buffer[start];
+            size_t const character_length = lead < 0x80 ? 1 : (lead & 0xe0) == 0xc0 ? 2 : (lead & 0xf0) == 0xe0 ? 3 : 4;
+            if (start + character_length > size)
+              size = start;
+          }
+          return size;
+        }
+        case XKB_COMPOSE_CANCELLED:
+          xkb_compose_state_reset(m_compose_state);
+          return 0;
+        case XKB_COMPOSE_NOTHING:
+          break;
+      }
     }
-    Dout(dc::finish, "]");
-#endif
-    return xkb_state_key_get_consumed_mods2(m_state, code, XKB_CONSUMED_MODE_XKB);
+    // The returned size includes a terminating zero, and is zero if the keysym has no character.
+    int size = xkb_keysym_to_utf8(keysym, buffer.data(), buffer.size());
+    if (size <= 1)
+      return 0;
+    // Control characters (Return, Tab, BackSpace, Escape, Delete ...) are not text.
+    unsigned char c = buffer[0];
+    if (size == 2 && (c < 0x20 || c == 0x7f))
+      return 0;
+    return size - 1;
   }
 
   uint8_t device_id() const { return m_device_id; }
   uint8_t opcode() const { return m_xkb_opcode; }
   uint8_t base_error() const { return m_xkb_base_error; }
+  bool detectable_auto_repeat() const { return m_detectable_auto_repeat; }
+
+  Xkb()
+  {
+    KeymapCache::instance().add_connection();
+  }
 
   ~Xkb()
   {
-    if (m_state)
-      xkb_state_unref(m_state);
-    if (m_keymap)
-      xkb_keymap_unref(m_keymap);
-    if (m_ctx)
-      xkb_context_unref(m_ctx);
+    if (m_compose_state)
+      xkb_compose_state_unref(m_compose_state);
+    KeymapCache::instance().remove_connection();
   }
 };
 
@@ -0,0 +1,58 @@
+#include "sys.h"
+#include "XkbKeymapLoader.h"
+#include "Connection.h"
+
+namespace task {
+
+XkbKeymapLoader::XkbKeymapLoader(boost::intrusive_ptr<xcb::Connection> connection COMMA_CWDEBUG_ONLY(bool debug)) :
+  AIStatefulTask(CWDEBUG_ONLY(debug)), m_connection(std::move(connection))
+{
+  DoutEntering(dc::statefultask(mSMDebug), "XkbKeymapLoader() [" << (void*)this << "]");
+}
+
+XkbKeymapLoader::~XkbKeymapLoader()
+{
+  DoutEntering(dc::statefultask(mSMDebug), "~XkbKeymapLoader() [" << (void*)this << "]");
+}
+
+char const* XkbKeymapLoader::state_str_impl(state_type run_state) const
+{
+  switch(run_state)
+  {
+    AI_CASE_RETURN(XkbKeymapLoader_start);
+    AI_CASE_RETURN(XkbKeymapLoader_done);
+  }
+  AI_NEVER_REACHED;
+}
+
+char const* XkbKeymapLoader::task_name_impl() const
+{
+  return "XkbKeymapLoader";
+}
+
+void XkbKeymapLoader::initialize_impl()
+{
+  DoutEntering(dc::statefultask(mSMDebug), "XkbKeymapLoader::initialize_impl() [" << (void*)this << "]");
+  set_state(XkbKeymapLoader_start);
+}
+
+void XkbKeymapLoader::multiplex_impl(state_type run_state)
+{
+  switch (run_state)
+  {
+    case XkbKeymapLoader_start:
+      m_connection->load_keymaps();
+      set_state(XkbKeymapLoader_done);
+      [[fallthrough]];
+    case XkbKeymapLoader_done:
+      finish();
+      break;
+  }
+}
+
+void XkbKeymapLoader::finish_impl()
+{
+  m_connection.reset();
+}
+
+} // namespace task
@@ -0,0 +1,56 @@
+#pragma once
+
+#include "statefultask/AIStatefulTask.h"
+#include "debug.h"
+
+namespace xcb {
+class Connection;
+} // namespace xcb
+
+namespace task {
+
+// A task that downloads and compiles a new keymap after a XKB MapNotify, so that the input thread doesn't have to.
+//
+// Run this task with the handler of a thread pool queue where blocking is allowed.
+// The result is handed to the input thread by xcb::Connection::load_keymaps.
+class XkbKeymapLoader : public AIStatefulTask
+{
+ private:
+  boost::intrusive_ptr<xcb::Connection> m_connection;   // Released when the task finishes.
+
+ protected:
+  /// The base class of this task.
+  using direct_base_type = AIStatefulTask;
+
+  /// The different states of the stateful task.
+  enum XkbKeymapLoader_state_type {
+    XkbKeymapLoader_start = direct_base_type::state_end,
+    XkbKeymapLoader_done,
+  };
+
+ public:
+  /// One beyond the largest state of this task.
+  static constexpr state_type state_end = XkbKeymapLoader_done + 1;
+
+  /// Construct a XkbKeymapLoader object.
+  XkbKeymapLoader(boost::intrusive_ptr<xcb::Connection> connection COMMA_CWDEBUG_ONLY(bool debug));
+
+ protected:
+  /// Call finish() (or abort()), not delete.
+  ~XkbKeymapLoader() override;
+
+  /// Implementation of state_str for run states.
+  char const* state_str_impl(state_type run_state) const override;
+  char const* task_name_impl() const override;
+
+  /// Run bs_initialize.
+  void initialize_impl() override;
+
+  /// Handle mRunState.
+  void multiplex_impl(state_type run_state) override;
+
+  /// Release the connection.
+  void finish_impl() override;
+};
+
+} // namespace task
@@ -1,6 +1,5 @@
 #include "sys.h"
 #include "Errors.h"
-#include <magic_enum.hpp>
 #include <iostream>
 
 namespace xcb::errors {
@@ -8,14 +7,12 @@ namespace org::freedesktop::xcb {
 
 std::string to_string(Error error)
 {
-  auto sv = magic_enum::enum_name(error);
-  sv.remove_prefix(3);  // Remove "XE_" from the name.
-  return std::string{sv};
+  return std::string{to_string_view(error)};
 }
 
 std::ostream& operator<<(std::ostream& os, Error error)
 {
-  os << to_string(error);
+  os << to_string_view(error);
   return os;
 }
 
@@ -43,7 +40,7 @@ char const* XcbErrorCategory::name() const noexcept
 std::string XcbErrorCategory::message(int ev) const
 {
   auto error = static_cast<Error>(ev);
-  return to_string(error);
+  return std::string{to_string_view(error)};
 }
 
 XcbErrorCategory const theXcbErrorCategory { };
@@ -1,7 +1,9 @@
 #pragma once
 
 #include <system_error>
+#include <array>
 #include <string>
+#include <string_view>
 #include <iosfwd>
 #include <xcb/xcb.h>
 
@@ -21,6 +23,24 @@ enum class Error
   XE_XCB_CONN_CLOSED_INVALID_SCREEN     = XCB_CONN_CLOSED_INVALID_SCREEN
 };
 
+// The names of the errors, indexed by their value.
+inline constexpr std::array<std::string_view, 7> error_names = {
+  "Success",
+  "XCB_CONN_ERROR",
+  "XCB_CONN_CLOSED_EXT_NOTSUPPORTED",
+  "XCB_CONN_CLOSED_MEM_INSUFFICIENT",
+  "XCB_CONN_CLOSED_REQ_LEN_EXCEED",
+  "XCB_CONN_CLOSED_PARSE_ERR",
+  "XCB_CONN_CLOSED_INVALID_SCREEN"
+};
+
+// Return the name of error, without allocating memory.
+constexpr std::string_view to_string_view(Error error)
+{
+  auto index = static_cast<size_t>(error);
+  return index < error_names.size() ? error_names[index] : "XCB_CONN_UNKNOWN_ERROR";
+}
+
 // Functions that will be found using Argument-dependent lookup.
 std::string to_string(Error error);
 std::ostream& operator<<(std::ostream& os, Error error);
@@ -0,0 +1,46 @@
+#include "sys.h"
+#include "ProtocolErrors.h"
+#include <iostream>
+
+namespace xcb::errors {
+namespace org::freedesktop::xcb {
+
+std::ostream& operator<<(std::ostream& os, ProtocolError error)
+{
+  os << to_string_view(error);
+  return os;
+}
+
+//----------------------------------------------------------------------------
+// X11 protocol errors (as received from the server).
+
+namespace {
+
+struct ProtocolErrorCategory : std::error_category
+{
+  char const* name() const noexcept override;
+  std::string message(int ev) const override;
+};
+
+char const* ProtocolErrorCategory::name() const noexcept
+{
+  return "x11";
+}
+
+std::string ProtocolErrorCategory::message(int ev) const
+{
+  auto error = static_cast<ProtocolError>(ev);
+  return std::string{to_string_view(error)};
+}
+
+ProtocolErrorCategory const theProtocolErrorCategory { };
+
+} // namespace
+
+std::error_code make_error_code(ProtocolError code)
+{
+  return std::error_code(static_cast<int>(code), theProtocolErrorCategory);
+}
+
+} // namespace org::freedesktop::xcb::Error
+} // namespace xcb::errors
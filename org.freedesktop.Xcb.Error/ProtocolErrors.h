@@ -0,0 +1,96 @@
+#pragma once
+
+#include <system_error>
+#include <array>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <iosfwd>
+#include <xcb/xcb.h>
+
+namespace xcb::errors {
+namespace org::freedesktop::xcb {
+
+// X11 protocol errors, as received in the error_code of a xcb_generic_error_t.
+// See https://www.x.org/releases/X11R7.7/doc/xproto/x11protocol.html#Errors
+//
+// Errors of extensions have an error_code that is relative to the base error of the extension,
+// which is only known at run time; those are mapped to values above last_core_error (see to_protocol_error).
+enum class ProtocolError
+{
+  Success = 0,
+  BadRequest            = XCB_REQUEST,
+  BadValue              = XCB_VALUE,
+  BadWindow             = XCB_WINDOW,
+  BadPixmap             = XCB_PIXMAP,
+  BadAtom               = XCB_ATOM,
+  BadCursor             = XCB_CURSOR,
+  BadFont               = XCB_FONT,
+  BadMatch              = XCB_MATCH,
+  BadDrawable           = XCB_DRAWABLE,
+  BadAccess             = XCB_ACCESS,
+  BadAlloc              = XCB_ALLOC,
+  BadColormap           = XCB_COLORMAP,
+  BadGContext           = XCB_G_CONTEXT,
+  BadIDChoice           = XCB_ID_CHOICE,
+  BadName               = XCB_NAME,
+  BadLength             = XCB_LENGTH,
+  BadImplementation     = XCB_IMPLEMENTATION,
+  last_core_error       = BadImplementation,
+  XkbKeyboard,                                  // The only error of the XKB extension (its base error).
+  Unknown                                       // An error of an extension that we don't know about.
+};
+
+// The names of the errors, indexed by their value.
+inline constexpr std::array<std::string_view, static_cast<size_t>(ProtocolError::Unknown) + 1> protocol_error_names = {
+  "Success",
+  "BadRequest",
+  "BadValue",
+  "BadWindow",
+  "BadPixmap",
+  "BadAtom",
+  "BadCursor",
+  "BadFont",
+  "BadMatch",
+  "BadDrawable",
+  "BadAccess",
+  "BadAlloc",
+  "BadColormap",
+  "BadGContext",
+  "BadIDChoice",
+  "BadName",
+  "BadLength",
+  "BadImplementation",
+  "XkbKeyboard",
+  "Unknown"
+};
+
+// Return the name of error, without allocating memory.
+constexpr std::string_view to_string_view(ProtocolError error)
+{
+  auto index = static_cast<size_t>(error);
+  return protocol_error_names[index < protocol_error_names.size() ? index : static_cast<size_t>(ProtocolError::Unknown)];
+}
+
+// Convert the error_code of a received error to a ProtocolError; xkb_base_error is the base error of the XKB extension (see Xkb::base_error).
+constexpr ProtocolError to_protocol_error(uint8_t error_code, uint8_t xkb_base_error)
+{
+  if (error_code <= static_cast<uint8_t>(ProtocolError::last_core_error))
+    return static_cast<ProtocolError>(error_code);
+  if (error_code == xkb_base_error)
+    return ProtocolError::XkbKeyboard;
+  return ProtocolError::Unknown;
+}
+
+// Functions that will be found using Argument-dependent lookup.
+std::ostream& operator<<(std::ostream& os, ProtocolError error);
+inline char const* get_domain(ProtocolError) { return "x11:org.freedesktop.xcb.ProtocolError"; }
+std::error_code make_error_code(ProtocolError ec);
+
+} // namespace org::freedesktop::xcb::Error
+} // namespace xcb::errors
+
+// Register ProtocolError as valid error code.
+namespace std {
+template<> struct is_error_code_enum<xcb::errors::org::freedesktop::xcb::ProtocolError> : true_type { };
+} // namespace std
@@ -0,0 +1,101 @@
+#include "sys.h"
+#include "xcb-task/ErrorRouter.h"
+#include <cstdint>
+#include <iostream>
+#include <vector>
+#include "debug.h"
+
+namespace {
+
+// What a handler was called with.
+struct Call
+{
+  uint32_t sequence;
+  uint8_t error_code;                   // Zero if the handler was called with nullptr (success).
+};
+
+std::vector<Call> calls;
+
+void record(xcb_void_cookie_t cookie, xcb_generic_error_t const* error)
+{
+  calls.push_back({ cookie.sequence, static_cast<uint8_t>(error ? error->error_code : 0) });
+}
+
+xcb_generic_error_t make_error(uint32_t sequence, uint8_t error_code)
+{
+  xcb_generic_error_t error{};
+  error.error_code = error_code;
+  error.sequence = static_cast<uint16_t>(sequence);
+  error.full_sequence = sequence;
+  return error;
+}
+
+} // namespace
+
+int main()
+{
+  Debug(debug::init());
+
+  xcb::ErrorRouter router;
+
+  // A request is only known to have succeeded after receiving something with a later sequence number.
+  router.add({ 10 }, record);
+  ASSERT(router.outstanding() == 1);
+  router.retire(10);
+  ASSERT(calls.empty() && router.outstanding() == 1);
+  router.retire(11);
+  ASSERT(calls.size() == 1 && calls[0].sequence == 10 && calls[0].error_code == 0);
+  ASSERT(router.outstanding() == 0);
+  calls.clear();
+
+  // A failed request is routed once, and not reported again when it is retired.
+  router.add({ 20 }, record);
+  ASSERT(router.route(make_error(20, XCB_WINDOW)));
+  ASSERT(calls.size() == 1 && calls[0].sequence == 20 && calls[0].error_code == XCB_WINDOW);
+  ASSERT(router.outstanding() == 0);
+  router.retire(21);
+  ASSERT(calls.size() == 1);
+  ASSERT(!router.route(make_error(22, XCB_WINDOW)));
+  calls.clear();
+
+  // A retired slot is reused without overflow.
+  router.add({ 30 }, record);
+  router.retire(31);
+  calls.clear();
+  router.add({ 30 + 256 }, record);
+  ASSERT(router.outstanding() == 1);
+  router.retire(30 + 257);
+  ASSERT(calls.size() == 1 && calls[0].sequence == 30 + 256);
+  calls.clear();
+
+  // A slot that is still in use is moved to the overflow list, and can still be routed and retired.
+  router.add({ 1005 }, record);
+  router.add({ 1005 + 256 }, record);
+  router.add({ 1005 + 512 }, record);
+  ASSERT(router.outstanding() == 3);
+  ASSERT(router.route(make_error(1005, XCB_DRAWABLE)));
+  ASSERT(calls.size() == 1 && calls[0].sequence == 1005 && calls[0].error_code == XCB_DRAWABLE);
+  ASSERT(router.outstanding() == 2);
+  router.retire(1005 + 512);
+  ASSERT(calls.size() == 2 && calls[1].sequence == 1005 + 256 && calls[1].error_code == 0);
+  ASSERT(router.outstanding() == 1);
+  ASSERT(router.route(make_error(1005 + 512, XCB_MATCH)));
+  ASSERT(calls.size() == 3 && calls[2].sequence == 1005 + 512 && calls[2].error_code == XCB_MATCH);
+  ASSERT(router.outstanding() == 0);
+  calls.clear();
+
+  // Sequence numbers wrap around; requests are retired in the order in which they were sent.
+  router.add({ 0xfffffffe }, record);
+  router.add({ 0xffffffff }, record);
+  router.add({ 0 }, record);
+  router.add({ 2 }, record);
+  router.retire(1);
+  ASSERT(calls.size() == 3);
+  ASSERT(calls[0].sequence == 0xfffffffe && calls[1].sequence == 0xffffffff && calls[2].sequence == 0);
+  ASSERT(router.outstanding() == 1);
+  router.retire(3);
+  ASSERT(calls.size() == 4 && calls[3].sequence == 2);
+  ASSERT(router.outstanding() == 0);
+
+  std::cout << "Success." << std::endl;
+}
@@ -0,0 +1,74 @@
+#include "sys.h"
+#include "xcb-task/Region.h"
+#include <cstdint>
+#include <iostream>
+#include "debug.h"
+
+namespace {
+
+uint32_t area(xcb::Region const& region)
+{
+  uint32_t sum = 0;
+  for (xcb_rectangle_t const& rectangle : region.rectangles())
+    sum += rectangle.width * rectangle.height;
+  return sum;
+}
+
+bool overlap(xcb_rectangle_t const& a, xcb_rectangle_t const& b)
+{
+  return a.x < b.x + b.width && b.x < a.x + a.width && a.y < b.y + b.height && b.y < a.y + a.height;
+}
+
+bool is_disjoint(xcb::Region const& region)
+{
+  auto rectangles = region.rectangles();
+  for (size_t i = 0; i < rectangles.size(); ++i)
+    for (size_t j = i + 1; j < rectangles.size(); ++j)
+      if (overlap(rectangles[i], rectangles[j]))
+        return false;
+  return true;
+}
+
+} // namespace
+
+int main()
+{
+  Debug(debug::init());
+
+  xcb::Region region;
+  ASSERT(region.empty());
+
+  // Empty rectangles are ignored.
+  region.add({ 10, 10, 0, 5 });
+  ASSERT(region.empty());
+
+  // A rectangle that is already covered adds nothing.
+  region.add({ 0, 0, 100, 100 });
+  region.add({ 10, 10, 20, 20 });
+  ASSERT(region.rectangles().size() == 1);
+  ASSERT(area(region) == 100 * 100);
+
+  // Overlapping rectangles only add the uncovered parts.
+  region.add({ 50, 50, 100, 100 });
+  ASSERT(is_disjoint(region));
+  ASSERT(area(region) == 100 * 100 + 100 * 100 - 50 * 50);
+
+  // Adjacent rectangles of the same height (or width) are merged.
+  region.clear();
+  region.add({ 0, 0, 10, 10 });
+  region.add({ 10, 0, 10, 10 });
+  region.add({ 0, 10, 20, 10 });
+  ASSERT(region.rectangles().size() == 1);
+  xcb_rectangle_t box = region.bounding_box();
+  ASSERT(box.x == 0 && box.y == 0 && box.width == 20 && box.height == 20);
+
+  // Too many rectangles are replaced by the bounding box.
+  region.clear();
+  for (int i = 0; i <= static_cast<int>(xcb::Region::max_rectangles); ++i)
+    region.add({ static_cast<int16_t>(20 * i), static_cast<int16_t>(20 * i), 10, 10 });
+  ASSERT(region.rectangles().size() == 1);
+  box = region.rectangles()[0];
+  ASSERT(box.x == 0 && box.y == 0 && box.width == 20 * xcb::Region::max_rectangles + 10 && box.height == box.width);
+
+  std::cout << "Success." << std::endl;
+}
@@ -0,0 +1,74 @@
+#include "sys.h"
+#include "xcb-task/WindowRegistry.h"
+#include <chrono>
+#include <iostream>
+#include <iomanip>
+#include <map>
+#include <random>
+#include <vector>
+#include "debug.h"
+
+namespace {
+
+// Typical values for a local X server.
+constexpr uint32_t resource_id_base = 0x3a00000;
+constexpr uint32_t resource_id_mask = 0x1fffff;
+
+constexpr int lookups = 10000000;
+
+// Used to make sure the benchmark loops aren't optimized away.
+uintptr_t volatile sink;
+
+// Return the average time of a lookup in nanoseconds.
+template<typename LOOKUP>
+double measure(std::vector<xcb_window_t> const& handles, LOOKUP lookup)
+{
+  // Look up the windows in a random order.
+  std::vector<xcb_window_t> order(4096);
+  std::mt19937 rng(42);
+  std::uniform_int_distribution<size_t> dist(0, handles.size() - 1);
+  for (auto& handle : order)
+    handle = handles[dist(rng)];
+
+  uintptr_t sum = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < lookups; ++i)
+    sum += lookup(order[i & 4095]);
+  auto stop = std::chrono::steady_clock::now();
+  sink = sum;
+  return std::chrono::duration<double, std::nano>(stop - start).count() / lookups;
+}
+
+} // namespace
+
+int main()
+{
+  Debug(debug::init());
+
+  std::cout << "Number of windows    WindowRegistry    std::map" << std::endl;
+  for (int number_of_windows : { 1, 100, 10000 })
+  {
+    xcb::WindowRegistry registry;
+    registry.init(resource_id_base, resource_id_mask);
+    std::map<xcb_window_t, xcb::WindowBase*> map;
+
+    // Generate IDs like xcb_generate_id does; every window also uses a few other resources (GCs, pixmaps, ...).
+    std::vector<xcb_window_t> handles;
+    uint32_t last = 0;
+    for (int w = 0; w < number_of_windows; ++w)
+    {
+      last += 3;
+      xcb_window_t handle = resource_id_base | last;
+      xcb::WindowBase* window = reinterpret_cast<xcb::WindowBase*>(uintptr_t{0x1000} + 8 * w);
+      registry.add(handle, window, false);
+      map.emplace(handle, window);
+      handles.push_back(handle);
+    }
+
+    double registry_ns = measure(handles, [&](xcb_window_t handle){ return registry.find(handle); });
+    double map_ns = measure(handles, [&](xcb_window_t handle){ return reinterpret_cast<uintptr_t>(map.find(handle)->second); });
+
+    std::cout << std::setw(17) << number_of_windows << std::fixed << std::setprecision(2) <<
+      std::setw(15) << registry_ns << " ns" << std::setw(9) << map_ns << " ns" << std::endl;
+  }
+}
@@ -0,0 +1,50 @@
+#include "sys.h"
+#include "xcb-task/org.freedesktop.Xcb.Error/Errors.h"
+#include "xcb-task/org.freedesktop.Xcb.Error/ProtocolErrors.h"
+#include <sstream>
+#include <iostream>
+#include <xcb/xcb.h>
+#include "debug.h"
+#ifdef CWDEBUG
+#include "utils/debug_ostream_operators.h"
+#endif
+
+int main()
+{
+  Debug(debug::init());
+
+  using namespace xcb::errors;
+  using namespace org::freedesktop::xcb;
+
+  // The names are available at compile time.
+  static_assert(to_string_view(ProtocolError::BadWindow) == "BadWindow");
+  static_assert(to_string_view(ProtocolError::BadImplementation) == "BadImplementation");
+  static_assert(to_string_view(static_cast<ProtocolError>(200)) == "Unknown");
+  static_assert(to_string_view(Error::XE_XCB_CONN_CLOSED_PARSE_ERR) == "XCB_CONN_CLOSED_PARSE_ERR");
+  static_assert(to_string_view(static_cast<Error>(100)) == "XCB_CONN_UNKNOWN_ERROR");
+
+  // Extension errors are mapped relative to the XKB base error.
+  uint8_t const xkb_base_error = 137;
+  static_assert(to_protocol_error(XCB_MATCH, xkb_base_error) == ProtocolError::BadMatch);
+  static_assert(to_protocol_error(xkb_base_error, xkb_base_error) == ProtocolError::XkbKeyboard);
+  static_assert(to_protocol_error(xkb_base_error + 1, xkb_base_error) == ProtocolError::Unknown);
+
+  std::stringstream ss;
+
+  // ProtocolError converts to a std::error_code of the "x11" category.
+  std::error_code ec = ProtocolError::BadAtom;
+  Dout(dc::notice, "ec = " << ec << " [" << ec.message() << "]");
+  ss << ec << " [" << ec.message() << "]";
+  ASSERT(ss.str() == "x11:5 [BadAtom]");
+  ss.str(std::string{});
+  ss.clear();
+
+  ss << to_protocol_error(xkb_base_error, xkb_base_error);
+  ASSERT(ss.str() == "XkbKeyboard");
+  std::cout << ss.str() << std::endl;
+
+  // The two categories are different.
+  ASSERT(std::error_code{static_cast<Error>(XCB_ATOM)} != ec);
+
+  Dout(dc::notice, "Success.");
+}